@@ -0,0 +1,288 @@
+/********************************************************************
+ *
+ *                     batch.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Implementation for the batch module. The manifest is read up
+ *     front and its jobs split into one contiguous range per worker.
+ *     A worker takes jobs from the front of its own range, in
+ *     manifest order; a worker whose range is empty steals the last
+ *     job of another's. No jobs are added once the workers start, so
+ *     a worker is done when every range is empty. Jobs are whole UM
+ *     runs, so a lock per range costs nothing worth measuring.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include "batch.h"
+
+#define INITIAL_JOBS 64
+#define FIELDS " \t\r\n"
+
+struct queue {
+        pthread_mutex_t lock;
+        size_t next;
+        size_t end;
+};
+
+struct pool;
+
+struct worker {
+        pthread_t thread;
+        struct queue queue;
+        struct pool *pool;
+        unsigned index;
+        long failed;
+};
+
+struct pool {
+        struct batch_job *jobs;
+        struct worker *workers;
+        unsigned num_workers;
+        bool (*run_job)(void *cl, const struct batch_job *job);
+        void *cl;
+};
+
+/* Purpose: copies a string
+* Input:    text -- the string
+* Output:   a copy on the heap
+*/
+static char *copy(const char *text)
+{
+        char *result = strdup(text);
+        assert(result != NULL);
+
+        return result;
+}
+
+/* Purpose: frees jobs read from a manifest
+* Input:    jobs -- the jobs
+*           num_jobs -- how many there are
+* Output:   none
+*/
+static void free_jobs(struct batch_job *jobs, size_t num_jobs)
+{
+        for (size_t i = 0; i < num_jobs; i++) {
+                free((char *)jobs[i].program);
+                free((char *)jobs[i].input);
+                free((char *)jobs[i].output);
+        }
+        free(jobs);
+}
+
+/* Purpose: reads every job in a manifest
+* Input:    path -- the manifest
+*           num_jobs -- set to the number of jobs read
+* Output:   the jobs, their strings on the heap, or NULL if the manifest
+*           can't be read; errors are reported on stderr
+*/
+static struct batch_job *read_manifest(const char *path, size_t *num_jobs)
+{
+        FILE *manifest = fopen(path, "r");
+        if (manifest == NULL) {
+                perror(path);
+                return NULL;
+        }
+
+        size_t capacity = INITIAL_JOBS;
+        struct batch_job *jobs = malloc(capacity * sizeof(*jobs));
+        assert(jobs != NULL);
+
+        char *line = NULL;
+        size_t line_size = 0;
+        unsigned line_number = 0;
+        bool ok = true;
+
+        *num_jobs = 0;
+
+        while (getline(&line, &line_size, manifest) != -1) {
+                char *rest;
+                char *fields[4];
+
+                line_number++;
+                fields[0] = strtok_r(line, FIELDS, &rest);
+                if (fields[0] == NULL || fields[0][0] == '#') {
+                        continue;
+                }
+                for (int i = 1; i < 4; i++) {
+                        fields[i] = strtok_r(NULL, FIELDS, &rest);
+                }
+
+                if (fields[2] == NULL || fields[3] != NULL) {
+                        fprintf(stderr, "%s:%u: expected \"program input "
+                                "output\"\n", path, line_number);
+                        ok = false;
+                        break;
+                }
+
+                if (*num_jobs == capacity) {
+                        capacity *= 2;
+                        jobs = realloc(jobs, capacity * sizeof(*jobs));
+                        assert(jobs != NULL);
+                }
+
+                struct batch_job *job = &jobs[(*num_jobs)++];
+
+                job->line = line_number;
+                job->program = copy(fields[0]);
+                job->input = (strcmp(fields[1], "-") == 0) ? NULL
+                                                           : copy(fields[1]);
+                job->output = copy(fields[2]);
+        }
+
+        free(line);
+        fclose(manifest);
+
+        if (!ok) {
+                free_jobs(jobs, *num_jobs);
+                return NULL;
+        }
+
+        return jobs;
+}
+
+/* Purpose: takes the next job from a worker's own range
+* Input:    worker -- the worker
+* Output:   the job, or NULL if the range is empty
+*/
+static struct batch_job *take_own(struct worker *worker)
+{
+        struct queue *queue = &worker->queue;
+        struct batch_job *job = NULL;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->next < queue->end) {
+                job = &worker->pool->jobs[queue->next++];
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        return job;
+}
+
+/* Purpose: takes the last job of another worker's range, trying each
+*           other worker in turn
+* Input:    worker -- the worker that has run out
+* Output:   the job, or NULL if every range is empty
+*/
+static struct batch_job *steal(struct worker *worker)
+{
+        struct pool *pool = worker->pool;
+
+        for (unsigned i = 1; i < pool->num_workers; i++) {
+                struct worker *victim = &pool->workers[(worker->index + i) %
+                                                       pool->num_workers];
+                struct queue *queue = &victim->queue;
+                struct batch_job *job = NULL;
+
+                pthread_mutex_lock(&queue->lock);
+                if (queue->next < queue->end) {
+                        job = &pool->jobs[--queue->end];
+                }
+                pthread_mutex_unlock(&queue->lock);
+
+                if (job != NULL) {
+                        return job;
+                }
+        }
+
+        return NULL;
+}
+
+/* Purpose: runs jobs until there are none left anywhere
+* Input:    cl -- the worker
+* Output:   NULL
+*/
+static void *work(void *cl)
+{
+        struct worker *worker = cl;
+        struct pool *pool = worker->pool;
+        struct batch_job *job;
+
+        while ((job = take_own(worker)) != NULL ||
+               (job = steal(worker)) != NULL) {
+                if (!pool->run_job(pool->cl, job)) {
+                        worker->failed++;
+                }
+        }
+
+        return NULL;
+}
+
+/* Purpose: runs every job of a manifest on a pool of threads
+* Input:    manifest -- the manifest's path
+*           num_threads -- how many workers to run
+*           run_job -- runs one job, returning false if it failed
+*           cl -- passed to run_job
+* Output:   the number of failed jobs, or -1 if the manifest can't be
+*           read
+*/
+long batch_run(const char *manifest, unsigned num_threads,
+               bool run_job(void *cl, const struct batch_job *job), void *cl)
+{
+        size_t num_jobs;
+        struct batch_job *jobs = read_manifest(manifest, &num_jobs);
+
+        if (jobs == NULL) {
+                return -1;
+        }
+
+        if (num_threads > num_jobs) {
+                num_threads = num_jobs;
+        }
+        if (num_threads == 0) {
+                num_threads = 1;
+        }
+
+        struct pool pool = {
+                .jobs = jobs,
+                .workers = calloc(num_threads, sizeof(struct worker)),
+                .num_workers = num_threads,
+                .run_job = run_job,
+                .cl = cl
+        };
+        assert(pool.workers != NULL);
+
+        for (unsigned i = 0; i < num_threads; i++) {
+                struct worker *worker = &pool.workers[i];
+
+                worker->pool = &pool;
+                worker->index = i;
+                worker->queue.next = num_jobs * i / num_threads;
+                worker->queue.end = num_jobs * (i + 1) / num_threads;
+                pthread_mutex_init(&worker->queue.lock, NULL);
+        }
+
+        /* Worker 0 is this thread. */
+        for (unsigned i = 1; i < num_threads; i++) {
+                int error = pthread_create(&pool.workers[i].thread, NULL,
+                                           work, &pool.workers[i]);
+                assert(error == 0);
+        }
+
+        work(&pool.workers[0]);
+
+        long failed = pool.workers[0].failed;
+
+        for (unsigned i = 1; i < num_threads; i++) {
+                pthread_join(pool.workers[i].thread, NULL);
+                failed += pool.workers[i].failed;
+        }
+
+        for (unsigned i = 0; i < num_threads; i++) {
+                pthread_mutex_destroy(&pool.workers[i].queue.lock);
+        }
+        free(pool.workers);
+        free_jobs(jobs, num_jobs);
+
+        return failed;
+}
+
+#undef INITIAL_JOBS
+#undef FIELDS
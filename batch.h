@@ -0,0 +1,45 @@
+/********************************************************************
+ *
+ *                     batch.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Interface for the batch module, behind "um --batch". Reads a
+ *     manifest of jobs and runs them on a fixed pool of worker
+ *     threads. Each worker starts with its own share of the jobs and
+ *     steals from the others once its share runs out. A manifest
+ *     line is
+ *
+ *         program input output
+ *
+ *     separated by blanks, with "-" as the input for none. Blank
+ *     lines and lines starting with '#' are skipped.
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#ifndef BATCH
+#define BATCH
+
+/* One line of a manifest. */
+struct batch_job {
+        unsigned line;
+        const char *program;
+        const char *input;      /* NULL for no input */
+        const char *output;
+};
+
+/* Runs every job in the manifest through run_job on num_threads workers.
+ * run_job must be safe to call from several threads at once. Returns
+ * the number of jobs for which run_job returned false, or -1 if the
+ * manifest can't be read; errors are reported on stderr. */
+long batch_run(const char *manifest, unsigned num_threads,
+               bool run_job(void *cl, const struct batch_job *job), void *cl);
+
+#endif
@@ -0,0 +1,88 @@
+/********************************************************************
+ *
+ *                     churn_bench.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Microbenchmark for the memory_segment module. Keeps a fixed
+ *     number of segments mapped and repeatedly unmaps one of them
+ *     and maps a replacement of a random small size, the pattern
+ *     sandmark.umz spends much of its time in, then reports the
+ *     cost of each map/unmap pair.
+ *
+ *     Usage: churn_bench [pairs [live_segments]]
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include "memory_segment.h"
+
+#define DEFAULT_PAIRS 20000000
+#define DEFAULT_LIVE 1000
+#define MAX_WORDS 64
+
+/* Purpose: reads the monotonic clock
+* Input:    none
+* Output:   the current time in seconds
+*/
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 3) {
+                fprintf(stderr, "Usage: %s [pairs [live_segments]]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        long pairs = (argc > 1) ? atol(argv[1]) : DEFAULT_PAIRS;
+        long live = (argc > 2) ? atol(argv[2]) : DEFAULT_LIVE;
+        assert(pairs > 0 && live > 0);
+
+        mem_T memory = mem_new();
+        uint32_t *ids = malloc(live * sizeof(*ids));
+        assert(ids != NULL);
+
+        /* m[0] stays mapped, as it would under a running program */
+        map_segment(memory, 1);
+
+        for (long i = 0; i < live; i++) {
+                ids[i] = map_segment(memory, 1 + rand() % MAX_WORDS);
+        }
+
+        double start = now();
+
+        for (long i = 0; i < pairs; i++) {
+                long slot = i % live;
+
+                unmap_segment(memory, ids[slot]);
+                ids[slot] = map_segment(memory, 1 + (i * 7919) % MAX_WORDS);
+        }
+
+        double elapsed = now() - start;
+
+        printf("%ld map/unmap pairs over %ld live segments: "
+               "%.3f s, %.1f ns per pair\n",
+               pairs, live, elapsed, elapsed * 1e9 / pairs);
+
+        free(ids);
+        mem_free(memory);
+
+        return EXIT_SUCCESS;
+}
+
+#undef DEFAULT_PAIRS
+#undef DEFAULT_LIVE
+#undef MAX_WORDS
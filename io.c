@@ -10,37 +10,357 @@
  *     
  *     Implementation for IO module. Contains functions necessary
  *     to utilize the I/O devices in the UM machine
- *     that perform the input and output instructions.
+ *     that perform the input and output instructions. All state
+ *     lives in the io_T, so machines on different threads never
+ *     share a buffer. The file descriptor devices are just one pair
+ *     of callbacks, fd_fill and fd_drain, over a ring the io_T owns.
  ********************************************************************/
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "io.h"
 
+struct io_T {
+        /* Input is handed out from [in_next, in_end), the current span. */
+        const unsigned char *in_next;
+        const unsigned char *in_end;
+        bool in_done;
+
+        /* the last fill had nothing yet */
+        bool in_waiting;
+
+        struct io_callbacks callbacks;
+        struct io_ring *ring;
+
+        /* drain after every byte, for unbuffered output */
+        bool unbuffered;
+
+        /*
+         * For io_new's devices. When in_fd is a regular file the first
+         * span is the whole file, mapped into memory; otherwise spans are
+         * read INPUT_BUFFER_SIZE bytes at a time into in_buffer. Output
+         * reaches out_fd one write(2) per drain.
+         */
+        int in_fd;
+        int out_fd;
+        unsigned char *in_buffer;
+        void *in_map;
+        size_t in_map_length;
+        bool in_started;
+        struct io_ring own_ring;
+};
+
+/* Purpose: maps the input into memory if it is a nonempty regular file,
+*           starting from its current offset
+* Input:    io -- the devices
+*           bytes, length -- set to the rest of the file
+* Output:   true if the file was mapped
+*/
+static bool map_input(io_T io, const unsigned char **bytes, size_t *length)
+{
+        struct stat info;
+
+        if (fstat(io->in_fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+            info.st_size == 0) {
+                return false;
+        }
+
+        off_t offset = lseek(io->in_fd, 0, SEEK_CUR);
+        if (offset < 0 || offset >= info.st_size) {
+                return false;
+        }
+
+        void *file = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+                          io->in_fd, 0);
+        if (file == MAP_FAILED) {
+                return false;
+        }
+
+        madvise(file, info.st_size, MADV_SEQUENTIAL);
+
+        io->in_map = file;
+        io->in_map_length = info.st_size;
+        *bytes = (const unsigned char *)file + offset;
+        *length = info.st_size - offset;
+
+        return true;
+}
+
+/* Purpose: fetches the next span of input from in_fd: the whole file if
+*           it can be mapped, otherwise the next read(2)
+* Input:    cl -- the devices
+*           bytes, length -- set to the span, empty at end of input
+* Output:   false if in_fd is nonblocking and has nothing to read yet
+*/
+static bool fd_fill(void *cl, const unsigned char **bytes, size_t *length)
+{
+        io_T io = cl;
+
+        *length = 0;
+
+        if (!io->in_started) {
+                io->in_started = true;
+
+                if (map_input(io, bytes, length)) {
+                        return true;
+                }
+
+                io->in_buffer = malloc(INPUT_BUFFER_SIZE);
+                assert(io->in_buffer != NULL);
+        }
+
+        /* A mapped file was the only span. */
+        if (io->in_map != NULL) {
+                return true;
+        }
+
+        ssize_t got;
+
+        do {
+                got = read(io->in_fd, io->in_buffer, INPUT_BUFFER_SIZE);
+        } while (got < 0 && errno == EINTR);
+
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return false;
+        }
+
+        *bytes = io->in_buffer;
+        *length = (got > 0) ? got : 0;
+
+        return true;
+}
+
+/* Purpose: writes bytes to a file descriptor, retrying after partial
+*           writes
+* Input:   fd -- where to write
+*          bytes -- the bytes to write
+*          length -- how many there are
+* Output:  none
+*/
+static void write_all(int fd, const unsigned char *bytes, size_t length)
+{
+        while (length > 0) {
+                ssize_t written = write(fd, bytes, length);
+
+                if (written < 0) {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        return;
+                }
+
+                bytes += written;
+                length -= written;
+        }
+}
+
+/* Purpose: writes everything in the ring to out_fd and empties it
+* Input:    cl -- the devices
+*           ring -- their own ring
+* Output:   none
+*/
+static void fd_drain(void *cl, struct io_ring *ring)
+{
+        io_T io = cl;
+        size_t first = ring->tail & (ring->size - 1);
+        size_t used = ring->head - ring->tail;
+
+        if (first + used > ring->size) {
+                write_all(io->out_fd, ring->bytes + first, ring->size - first);
+                write_all(io->out_fd, ring->bytes, first + used - ring->size);
+        } else {
+                write_all(io->out_fd, ring->bytes + first, used);
+        }
+
+        /* Starting again at the front keeps the next batch in one piece. */
+        ring->head = 0;
+        ring->tail = 0;
+}
+
+/* Purpose: makes the I/O devices for one machine on a pair of file
+*           descriptors
+* Input:    in_fd -- where Input reads from
+*           out_fd -- where Output writes to
+*           output_size -- the output buffer size in bytes, or 0 for no
+*                          buffering
+* Output:   the new devices
+*/
+io_T io_new(int in_fd, int out_fd, size_t output_size)
+{
+        io_T io = calloc(1, sizeof(*io));
+        assert(io != NULL);
+
+        size_t size = 1;
+
+        while (size < output_size) {
+                size *= 2;
+        }
+
+        io->in_fd = in_fd;
+        io->out_fd = out_fd;
+        io->unbuffered = (output_size == 0);
+        io->own_ring.size = size;
+        io->own_ring.bytes = malloc(size);
+        assert(io->own_ring.bytes != NULL);
+
+        io->ring = &io->own_ring;
+        io->callbacks.fill = fd_fill;
+        io->callbacks.drain = fd_drain;
+        io->callbacks.cl = io;
+
+        return io;
+}
+
+/* Purpose: makes the I/O devices for one machine on the host's own
+*           callbacks and output ring
+* Input:    callbacks -- fetch input spans and drain the ring; copied
+*           ring -- where output goes; a power of two in size, and kept
+*                   by the host
+* Output:   the new devices
+*/
+io_T io_new_host(const struct io_callbacks *callbacks, struct io_ring *ring)
+{
+        assert(ring->size > 0 && (ring->size & (ring->size - 1)) == 0);
+
+        io_T io = calloc(1, sizeof(*io));
+        assert(io != NULL);
+
+        io->callbacks = *callbacks;
+        io->ring = ring;
+        io->in_fd = -1;
+        io->out_fd = -1;
+
+        return io;
+}
+
+/* Purpose: drains any output and frees the devices; descriptors and
+*           host buffers are left alone
+* Input:    io -- the devices
+* Output:   none
+*/
+void io_free(io_T io)
+{
+        output_flush(io);
+
+        if (io->in_map != NULL) {
+                munmap(io->in_map, io->in_map_length);
+        }
+
+        free(io->in_buffer);
+        free(io->own_ring.bytes);
+        free(io);
+}
+
+/* Purpose: moves on to the next span of input. Output is drained first,
+*           since the UM may be about to wait on a prompt it has just
+*           printed.
+* Input:    io -- the devices
+* Output:   false if there is no more input, or none yet
+*/
+static bool refill_input(io_T io)
+{
+        if (io->in_done) {
+                return false;
+        }
+
+        output_flush(io);
+
+        const unsigned char *bytes = NULL;
+        size_t length = 0;
+
+        io->in_waiting = !io->callbacks.fill(io->callbacks.cl, &bytes, 
+                                             &length);
+        if (io->in_waiting) {
+                return false;
+        }
+
+        if (length == 0) {
+                io->in_done = true;
+                return false;
+        }
+
+        io->in_next = bytes;
+        io->in_end = bytes + length;
+
+        return true;
+}
+
+/* Purpose: makes sure the next Input won't have to wait, fetching the
+*           next span if this one is used up
+* Input:    io -- the devices
+* Output:   false only if the fill callback has nothing yet; the UM
+*           should come back to the Input later
+*/
+bool input_ready(io_T io)
+{
+        if (io->in_next < io->in_end || io->in_done) {
+                return true;
+        }
+
+        return refill_input(io) || !io->in_waiting;
+}
 
 /* Purpose: To return a byte (within ASCII range) 
-*           that has been parsed through stdin
-* Input:    none
+*           that has been parsed through the input
+* Input:    io -- the devices
 *        
-* Output: a uint32_t byte from stdin
+* Output: a uint32_t byte of input, or 0xFFFFFFFF (all ones) once
+*         the input is exhausted
 */
-int input()
+uint32_t input(io_T io)
 {
-    int c = getchar();
-
-    if (c == EOF) {
-        c = ~(uint32_t)0;
-    }
+        if (io->in_next == io->in_end && !refill_input(io)) {
+                return ~(uint32_t)0;
+        }
 
-    return c;
+        return *io->in_next++;
 }
 
 /* Purpose: outputs a byte from a register within ASCII range
-* Input:   a uint32_t byte (that will be outputted)
+* Input:   io -- the devices
+*          a uint32_t byte (that will be outputted)
+*        
+* Output:  false if the ring is full and the drain callback left it
+*          so; nothing is output, and the UM should come back to the
+*          Output later
+*/
+bool output(io_T io, int op)
+{
+        struct io_ring *ring = io->ring;
+
+        if (ring->head - ring->tail == ring->size) {
+                io->callbacks.drain(io->callbacks.cl, ring);
+
+                if (ring->head - ring->tail == ring->size) {
+                        return false;
+                }
+        }
+
+        ring->bytes[ring->head++ & (ring->size - 1)] = op;
+
+        if (io->unbuffered) {
+                output_flush(io);
+        }
+
+        return true;
+}
+
+/* Purpose: hands everything in the output ring to the drain callback
+* Input:   io -- the devices
 *        
 * Output:  none
 */
-void output(int op)
+void output_flush(io_T io)
 {
-        putchar(op);
+        struct io_ring *ring = io->ring;
+
+        if (ring->head != ring->tail) {
+                io->callbacks.drain(io->callbacks.cl, ring);
+        }
 }
@@ -10,21 +10,88 @@
  *     
  *     Interface for IO module. Contains functions necessary
  *     to utilize the I/O devices in the UM machine
- *     that perform both input and output instructions.
+ *     that perform both input and output instructions. Each
+ *     machine has its own io_T, so several can run in one process.
+ *
+ *     Input is taken a span at a time and Output goes into a ring
+ *     buffer, with callbacks to fetch the next span and to drain the
+ *     ring. io_new() supplies callbacks that read and write a pair of
+ *     file descriptors; io_new_host() takes the host's own, so input
+ *     can be read straight out of the host's buffers and output left
+ *     in a ring the host owns, with no call or copy per byte.
  ********************************************************************/
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#ifndef IO
+#define IO
+
+/* Default size of the output buffer, in bytes. */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/* Size of each read(2) from stdin when it is not a regular file. */
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct io_T *io_T;
+
+/* 
+ * Output waiting to be consumed. The machine writes at head and the host
+ * consumes from tail; both only ever grow, and byte i of the stream is
+ * at bytes[i & (size - 1)].
+ */
+struct io_ring {
+        unsigned char *bytes;
+        size_t size;            /* a power of two */
+        size_t head;
+        size_t tail;
+};
+
+struct io_callbacks {
+        /* Points *bytes and *length at the next span of input, which must
+         * stay put until fill is called again; a length of 0 ends the
+         * input. Returns false if there is nothing yet, which stops the
+         * machine with UM_NEEDS_INPUT. */
+        bool (*fill)(void *cl, const unsigned char **bytes, size_t *length);
+
+        /* Consumes output by advancing ring->tail. Called when the ring
+         * is full, and before the machine waits for input. A drain that
+         * can't take anything yet, like a socket that would block, may
+         * leave a full ring full, which stops the machine with
+         * UM_OUTPUT_FULL before the Output; io_new's drain blocks. */
+        void (*drain)(void *cl, struct io_ring *ring);
+
+        void *cl;
+};
+
+/* Makes I/O devices reading in_fd and writing out_fd, with an output
+ * buffer of output_size bytes rounded up to a power of two; 0 writes
+ * each character immediately. The descriptors stay open when the
+ * devices are freed. */
+io_T io_new(int in_fd, int out_fd, size_t output_size);
+
+/* Makes I/O devices on the host's callbacks and output ring, neither of
+ * which is copied; both must outlive the devices. */
+io_T io_new_host(const struct io_callbacks *callbacks, struct io_ring *ring);
+
+/* Flushes any buffered output and frees the devices. */
+void io_free(io_T io);
+
+/* Fetches input for the next Input if none is left; false if there is
+ * none to be had yet. */
+bool input_ready(io_T io);
 
-#ifndef io
-#define io
+/* Returns the next input byte, or 0xFFFFFFFF at end of input. */
+uint32_t input(io_T io);
 
-/* Returns input from stdin. */
-int input();
+/* Prints a character; false, with nothing printed, if the ring is full
+ * and the drain callback couldn't make room. */
+bool output(io_T io, int op);
 
-/* Prints a character to stdout. */
-void output(int op);
+/* Hands any output in the ring to the drain callback. */
+void output_flush(io_T io);
 
 #endif
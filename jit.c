@@ -0,0 +1,894 @@
+/********************************************************************
+ *
+ *                     jit.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Implementation for the jit module. Each compiled block is a
+ *     function taking the register file and the memory; it keeps
+ *     UM registers r0-r7 in host registers r8d-r15d, and returns the
+ *     next pc in the low 32 bits of rax. Bit 32 is set when the
+ *     interpreter has to execute the instruction at that pc itself;
+ *     otherwise the block ended with a Load Program of m[0] and the
+ *     pc is a jump target, possibly the start of another block.
+ *
+ *     A block is only ever entered at its first word, so what is
+ *     known at one of its words holds every time that word runs. The
+ *     compiler follows which registers hold constants from Load Value
+ *     and which segment's header is still in rbx from an earlier
+ *     load or store: a segment looked up again through an unchanged
+ *     register costs nothing, segment 0 needs no bounds check, and a
+ *     store through a register known not to hold 0 skips the checks
+ *     for stores into code. Only map, unmap and Load Program change
+ *     the segment table or the sharing of a segment, and each of
+ *     them ends the block.
+ *
+ *     Every block shares one epilogue at the start of the code
+ *     buffer, which writes the registers back and returns. A store
+ *     that lands on a compiled word forgets just the blocks covering
+ *     it, which can only start up to MAX_BLOCK words before it; their
+ *     code stays in the buffer until it is thrown away wholesale, when
+ *     m[0] is replaced or when the buffer fills.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#define CODE_SIZE (32 * 1024 * 1024)
+#define HOT_COUNT 16
+#define NEVER UINT16_MAX
+#define MAX_BLOCK 4096
+#define MAX_INST_BYTES 160
+#define LOG_SIZE 256
+
+/* bit 32 of a block's result: interpret the instruction at pc */
+#define INTERPRET ((uint64_t)1 << 32)
+
+/* host registers, by x86 encoding */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define HOST(um_register) (8 + (um_register))
+#define NO_REGISTER 8
+
+/* the short jumps that skip over a side exit */
+#define JB 0x72
+#define JE 0x74
+#define JNE 0x75
+#define JMP 0xEB
+
+/* bytes in a side exit: movabs rax, imm64; jmp rel32 */
+#define EXIT_BYTES 15
+
+typedef uint64_t (*block_fn)(uint32_t *registers, mem_T memory);
+
+/* what the compiler knows at a word of the block it is compiling */
+struct facts {
+        bool known[8];
+        uint32_t value[8];
+
+        /* the UM register whose segment's header is in rbx, or
+         * NO_REGISTER; whether that segment is m[0], and whether it
+         * has been found to be unshared */
+        unsigned cached;
+        bool cached_zero;
+        bool unshared;
+};
+
+struct jit_T {
+        unsigned char *code;
+        size_t code_used;
+
+        /* per word of m[0]: its compiled block, if one starts there, and
+         * the block's last word, how often it has been jumped to, and how
+         * many blocks cover it */
+        block_fn *blocks;
+        uint32_t *ends;
+        uint16_t *counts;
+        uint16_t *covered;
+        uint32_t length;
+
+        /* words of m[0] that compiled code stored into, for the caller to
+         * hear about once the block returns */
+        void (*stored)(void *cl, uint32_t index);
+        void *cl;
+        uint32_t log_used;
+        uint32_t log[LOG_SIZE];
+};
+
+/* Purpose: appends one byte of code
+* Input:    jit -- the compiler
+*           byte -- the byte
+* Output:   none
+*/
+static inline void emit(jit_T jit, unsigned byte)
+{
+        jit->code[jit->code_used++] = byte;
+}
+
+/* Purpose: appends a little-endian 32-bit value
+* Input:    jit -- the compiler
+*           value -- the value
+* Output:   none
+*/
+static inline void emit_u32(jit_T jit, uint32_t value)
+{
+        memcpy(jit->code + jit->code_used, &value, sizeof(value));
+        jit->code_used += sizeof(value);
+}
+
+/* Purpose: appends a 64-bit value
+* Input:    jit -- the compiler
+*           value -- the value
+* Output:   none
+*/
+static inline void emit_u64(jit_T jit, uint64_t value)
+{
+        memcpy(jit->code + jit->code_used, &value, sizeof(value));
+        jit->code_used += sizeof(value);
+}
+
+/* Purpose: appends a 32-bit instruction on two registers, with a REX
+*           prefix when either is r8-r15
+* Input:    jit -- the compiler
+*           opcode -- one opcode byte, or 0x0Fxx for two
+*           reg -- the register for the ModRM reg field (or /digit)
+*           rm -- the register for the ModRM rm field
+* Output:   none
+*/
+static void emit_rr(jit_T jit, unsigned opcode, unsigned reg, unsigned rm)
+{
+        unsigned rex = 0x40 | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+
+        if (rex != 0x40) {
+                emit(jit, rex);
+        }
+        if (opcode > 0xFF) {
+                emit(jit, opcode >> 8);
+        }
+        emit(jit, opcode & 0xFF);
+        emit(jit, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Purpose: appends an instruction whose memory operand is a field of
+*           the mem_T in rsi
+* Input:    jit -- the compiler
+*           wide -- true for a 64-bit operation (REX.W)
+*           opcode -- the opcode byte
+*           reg -- the register operand
+*           offset -- the field's offset in struct mem_T
+* Output:   none
+*/
+static void emit_memory_field(jit_T jit, bool wide, unsigned opcode,
+                              unsigned reg, size_t offset)
+{
+        unsigned rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1);
+
+        if (rex != 0x40) {
+                emit(jit, rex);
+        }
+        emit(jit, opcode);
+        emit(jit, 0x80 | ((reg & 7) << 3) | RSI);
+        emit_u32(jit, offset);
+}
+
+/* Purpose: appends a load or store between a register and word rdx of
+*           the segment whose header rbx points to
+* Input:    jit -- the compiler
+*           opcode -- 0x8B to load, 0x89 to store
+*           reg -- the register loaded or stored
+* Output:   none
+*/
+static void emit_segment_word(jit_T jit, unsigned opcode, unsigned reg)
+{
+        if (reg & 8) {
+                emit(jit, 0x44);
+        }
+        emit(jit, opcode);
+        emit(jit, 0x44 | ((reg & 7) << 3));          /* [base + index*s + d8] */
+        emit(jit, 0x93);                             /* rbx + rdx*4 */
+        emit(jit, offsetof(struct seg_T, segments));
+}
+
+/* Purpose: appends a short forward jump whose target is filled in later
+* Input:    jit -- the compiler
+*           opcode -- the jump's opcode
+* Output:   where to patch the target, for land()
+*/
+static size_t emit_jump(jit_T jit, unsigned opcode)
+{
+        emit(jit, opcode);
+        emit(jit, 0);
+
+        return jit->code_used;
+}
+
+/* Purpose: makes an earlier short jump land at the end of the code
+* Input:    jit -- the compiler
+*           jump -- the value emit_jump returned
+* Output:   none
+*/
+static void land(jit_T jit, size_t jump)
+{
+        assert(jit->code_used - jump < 128);
+        jit->code[jump - 1] = jit->code_used - jump;
+}
+
+/* Purpose: appends a movabs of an address into rcx
+* Input:    jit -- the compiler
+*           address -- the address
+* Output:   none
+*/
+static void emit_address(jit_T jit, const void *address)
+{
+        uint64_t value;
+
+        memcpy(&value, &address, sizeof(value));
+        emit(jit, 0x48);
+        emit(jit, 0xB9);
+        emit_u64(jit, value);
+}
+
+/* Purpose: appends a jump to the shared epilogue
+* Input:    jit -- the compiler
+* Output:   none
+*/
+static void emit_return(jit_T jit)
+{
+        emit(jit, 0xE9);
+        emit_u32(jit, (uint32_t)(0 - (jit->code_used + 4)));
+}
+
+/* Purpose: appends a side exit asking the interpreter to take over at pc
+* Input:    jit -- the compiler
+*           pc -- where the interpreter resumes
+* Output:   none
+*/
+static void emit_exit(jit_T jit, uint32_t pc)
+{
+        emit(jit, 0x48);                             /* movabs rax, imm64 */
+        emit(jit, 0xB8);
+        emit_u64(jit, INTERPRET | pc);
+        emit_return(jit);
+}
+
+/* Purpose: appends a side exit taken unless a condition holds
+* Input:    jit -- the compiler
+*           skip -- the short jump over the exit, taken when all is well
+*           pc -- where the interpreter resumes otherwise
+* Output:   none
+*/
+static void emit_exit_unless(jit_T jit, unsigned skip, uint32_t pc)
+{
+        emit(jit, skip);
+        emit(jit, EXIT_BYTES);
+        emit_exit(jit, pc);
+}
+
+/* Purpose: appends a move of a constant into a register
+* Input:    jit -- the compiler
+*           reg -- the host register
+*           value -- the constant
+* Output:   none
+*/
+static void emit_value(jit_T jit, unsigned reg, uint32_t value)
+{
+        if (reg & 8) {
+                emit(jit, 0x41);
+        }
+        emit(jit, 0xB8 | (reg & 7));                 /* mov reg, imm32 */
+        emit_u32(jit, value);
+}
+
+/* Purpose: tells whether a UM register is known to hold a value
+* Input:    facts -- what is known
+*           r -- the UM register
+*           value -- the value
+* Output:   true if r certainly holds value here
+*/
+static inline bool holds(const struct facts *facts, unsigned r,
+                         uint32_t value)
+{
+        return facts->known[r] && facts->value[r] == value;
+}
+
+/* Purpose: notes that an instruction has written a UM register
+* Input:    facts -- what is known, updated
+*           r -- the UM register
+*           known -- whether the value written is known
+*           value -- the value written, if known
+* Output:   none
+*/
+static void wrote(struct facts *facts, unsigned r, bool known,
+                  uint32_t value)
+{
+        facts->known[r] = known;
+        facts->value[r] = value;
+
+        if (facts->cached == r) {
+                facts->cached = NO_REGISTER;
+        }
+}
+
+/* Purpose: appends code leaving in rbx the header of the segment whose
+*           identifier is in a UM register, exiting if the identifier is
+*           outside the flat part of the segment table; nothing is
+*           appended if rbx already holds it
+* Input:    jit -- the compiler
+*           facts -- what is known, updated
+*           r -- the UM register holding the identifier
+*           pc -- the instruction being compiled
+* Output:   none
+*/
+static void emit_segment_lookup(jit_T jit, struct facts *facts, unsigned r,
+                                uint32_t pc)
+{
+        bool zero = holds(facts, r, 0);
+
+        if (facts->cached == r || (zero && facts->cached_zero)) {
+                facts->cached = r;
+                return;
+        }
+
+        if (zero) {
+                /* m[0] is always mapped */
+                emit_memory_field(jit, true, 0x8B, RBX,  /* mov rbx, ids */
+                                  offsetof(struct mem_T, mapped_ids));
+                emit(jit, 0x48);                     /* mov rbx, [rbx] */
+                emit(jit, 0x8B);
+                emit(jit, 0x1B);
+        } else {
+                /* cmp id, [rsi + mapped_length]; jb ok; exit */
+                emit_memory_field(jit, false, 0x3B, HOST(r),
+                                  offsetof(struct mem_T, mapped_length));
+                emit_exit_unless(jit, JB, pc);
+
+                emit_rr(jit, 0x89, HOST(r), RCX);    /* mov ecx, id */
+                emit_memory_field(jit, true, 0x8B, RBX,  /* mov rbx, ids */
+                                  offsetof(struct mem_T, mapped_ids));
+                emit(jit, 0x48);                     /* mov rbx, [rbx+rcx*8] */
+                emit(jit, 0x8B);
+                emit(jit, 0x1C);
+                emit(jit, 0xCB);
+        }
+
+        facts->cached = r;
+        facts->cached_zero = zero;
+        facts->unshared = false;
+}
+
+/* Purpose: appends the shared epilogue at the start of an empty buffer
+* Input:    jit -- the compiler
+* Output:   none
+*/
+static void emit_epilogue(jit_T jit)
+{
+        for (unsigned r = 0; r < 8; r++) {
+                emit(jit, 0x44);                     /* mov [rdi + 4r], r */
+                emit(jit, 0x89);
+                emit(jit, 0x40 | (r << 3) | RDI);
+                emit(jit, 4 * r);
+        }
+
+        for (unsigned r = 15; r >= 12; r--) {
+                emit(jit, 0x41);                     /* pop r */
+                emit(jit, 0x58 | (r & 7));
+        }
+
+        emit(jit, 0x58 | RBX);                       /* pop rbx */
+        emit(jit, 0xC3);                             /* ret */
+}
+
+/* Purpose: appends a block's prologue
+* Input:    jit -- the compiler
+* Output:   none
+*/
+static void emit_prologue(jit_T jit)
+{
+        emit(jit, 0x50 | RBX);                       /* push rbx */
+
+        for (unsigned r = 12; r <= 15; r++) {
+                emit(jit, 0x41);                     /* push r */
+                emit(jit, 0x50 | (r & 7));
+        }
+
+        for (unsigned r = 0; r < 8; r++) {
+                emit(jit, 0x44);                     /* mov r, [rdi + 4r] */
+                emit(jit, 0x8B);
+                emit(jit, 0x40 | (r << 3) | RDI);
+                emit(jit, 4 * r);
+        }
+}
+
+/* Purpose: works out an arithmetic instruction on constants
+* Input:    op_code -- add, multiply, divide or nand
+*           x, y -- its operands
+*           result -- set to the result
+* Output:   false if there is none, for a division by zero
+*/
+static bool fold(unsigned op_code, uint32_t x, uint32_t y, uint32_t *result)
+{
+        switch (op_code) {
+        case 3:
+                *result = x + y;
+                return true;
+        case 4:
+                *result = x * y;
+                return true;
+        case 5:
+                if (y == 0) {
+                        return false;
+                }
+                *result = x / y;
+                return true;
+        default:
+                *result = ~(x & y);
+                return true;
+        }
+}
+
+/* Purpose: appends the code for one instruction
+* Input:    jit -- the compiler
+*           facts -- what is known before it, updated to after it
+*           word -- the instruction
+*           pc -- where it is in m[0]
+* Output:   false if the instruction ends the block
+*/
+static bool emit_instruction(jit_T jit, struct facts *facts, uint32_t word,
+                             uint32_t pc)
+{
+        unsigned op_code = word >> 28;
+        unsigned ra = (word >> 6) & 0x7;
+        unsigned rb = (word >> 3) & 0x7;
+        unsigned rc = word & 0x7;
+        unsigned a = HOST(ra);
+        unsigned b = HOST(rb);
+        unsigned c = HOST(rc);
+        uint32_t value;
+
+        switch (op_code) {
+        case 0:
+                if (!facts->known[rc]) {
+                        emit_rr(jit, 0x85, c, c);    /* test c, c */
+                        emit_rr(jit, 0x0F45, a, b);  /* cmovne a, b */
+                        wrote(facts, ra, facts->known[rb] &&
+                                         holds(facts, ra, facts->value[rb]),
+                              facts->value[rb]);
+                } else if (facts->value[rc] != 0 && ra != rb) {
+                        emit_rr(jit, 0x89, b, a);    /* mov a, b */
+                        wrote(facts, ra, facts->known[rb], facts->value[rb]);
+                }
+                return true;
+        case 1:
+                emit_segment_lookup(jit, facts, rb, pc);
+                emit_rr(jit, 0x89, c, RDX);          /* mov edx, c */
+                emit_segment_word(jit, 0x8B, a);
+                wrote(facts, ra, false, 0);
+                return true;
+        case 2: {
+                emit_segment_lookup(jit, facts, ra, pc);
+
+                if (!facts->unshared) {
+                        /* cmp dword [rbx + refs], 1; je ok; exit */
+                        emit(jit, 0x83);
+                        emit(jit, 0x7B);
+                        emit(jit, offsetof(struct seg_T, refs));
+                        emit(jit, 1);
+                        emit_exit_unless(jit, JE, pc);
+                        facts->unshared = true;
+                }
+
+                emit_rr(jit, 0x89, b, RDX);          /* mov edx, b */
+
+                /* A store into m[0] is left to the interpreter if it
+                 * lands on compiled code, and logged otherwise. */
+                bool zero = holds(facts, ra, 0);
+                size_t plain = 0;
+
+                if (facts->known[ra] && !zero) {
+                        emit_segment_word(jit, 0x89, c);
+                        return true;
+                }
+                if (!zero) {
+                        emit_rr(jit, 0x85, a, a);
+                        plain = emit_jump(jit, JNE);
+                }
+
+                emit_address(jit, jit->covered);
+                emit(jit, 0x66);                     /* cmp word */
+                emit(jit, 0x83);                     /*   [rcx+rdx*2], 0 */
+                emit(jit, 0x3C);
+                emit(jit, 0x51);
+                emit(jit, 0);
+                emit_exit_unless(jit, JE, pc);
+
+                emit_address(jit, &jit->log_used);
+                emit(jit, 0x8B);                     /* mov eax, [rcx] */
+                emit(jit, 0x01);
+                emit(jit, 0x3D);                     /* cmp eax, LOG_SIZE */
+                emit_u32(jit, LOG_SIZE);
+                emit_exit_unless(jit, JB, pc);
+                emit(jit, 0x89);                     /* mov [rcx+rax*4+d8] */
+                emit(jit, 0x54);
+                emit(jit, 0x81);
+                emit(jit, offsetof(struct jit_T, log) -
+                          offsetof(struct jit_T, log_used));
+                emit(jit, 0xFF);                     /* inc dword [rcx] */
+                emit(jit, 0x01);
+
+                if (!zero) {
+                        land(jit, plain);
+                }
+                emit_segment_word(jit, 0x89, c);
+                return true;
+        }
+        case 3:
+        case 4:
+        case 5:
+        case 6:
+                if (facts->known[rb] && facts->known[rc] &&
+                    fold(op_code, facts->value[rb], facts->value[rc],
+                         &value)) {
+                        emit_value(jit, a, value);
+                        wrote(facts, ra, true, value);
+                        return true;
+                }
+
+                emit_rr(jit, 0x89, b, RAX);
+                if (op_code == 3) {
+                        emit_rr(jit, 0x01, c, RAX);  /* eax = b + c */
+                } else if (op_code == 4) {
+                        emit_rr(jit, 0x0FAF, RAX, c);    /* eax = b * c */
+                } else if (op_code == 5) {
+                        emit_rr(jit, 0x31, RDX, RDX);    /* eax = b / c */
+                        emit_rr(jit, 0xF7, 6, c);
+                } else {
+                        emit_rr(jit, 0x21, c, RAX);  /* eax = ~(b & c) */
+                        emit_rr(jit, 0xF7, 2, RAX);
+                }
+                emit_rr(jit, 0x89, RAX, a);
+                wrote(facts, ra, false, 0);
+                return true;
+        case 12:
+                /* Only a jump within m[0] stays in compiled code. */
+                if (!holds(facts, rb, 0)) {
+                        if (facts->known[rb]) {
+                                emit_exit(jit, pc);
+                                return false;
+                        }
+                        emit_rr(jit, 0x85, b, b);
+                        emit_exit_unless(jit, JE, pc);
+                }
+                emit_rr(jit, 0x89, c, RAX);          /* mov eax, c */
+                emit_return(jit);
+                return false;
+        case 13:
+                ra = (word >> 25) & 0x7;
+                emit_value(jit, HOST(ra), word & 0x1FFFFFF);
+                wrote(facts, ra, true, word & 0x1FFFFFF);
+                return true;
+        default:
+                /* halt, map, unmap, I/O and invalid opcodes */
+                emit_exit(jit, pc);
+                return false;
+        }
+}
+
+/* Purpose: tells whether an instruction can begin a compiled block
+* Input:    word -- the instruction
+* Output:   true if emit_instruction compiles it
+*/
+static inline bool compilable(uint32_t word)
+{
+        unsigned op_code = word >> 28;
+
+        return op_code <= 6 || op_code == 12 || op_code == 13;
+}
+
+/* Purpose: empties the code buffer, leaving only the epilogue, and
+*           forgets every block
+* Input:    jit -- the compiler
+* Output:   none
+*/
+static void flush(jit_T jit)
+{
+        mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_WRITE);
+        jit->code_used = 0;
+        emit_epilogue(jit);
+        mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC);
+
+        memset(jit->blocks, 0, jit->length * sizeof(*jit->blocks));
+        memset(jit->counts, 0, jit->length * sizeof(*jit->counts));
+        memset(jit->covered, 0, jit->length * sizeof(*jit->covered));
+}
+
+/* Purpose: compiles the block starting at pc
+* Input:    jit -- the compiler
+*           m0 -- the program
+*           start -- where the block starts
+* Output:   the compiled block
+*/
+static block_fn compile_block(jit_T jit, seg_T m0, uint32_t start)
+{
+        uint32_t most = m0->seg_length - start;
+        if (most > MAX_BLOCK) {
+                most = MAX_BLOCK;
+        }
+
+        if (CODE_SIZE - jit->code_used < (most + 2) * MAX_INST_BYTES) {
+                flush(jit);
+        }
+
+        mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_WRITE);
+
+        unsigned char *entry = jit->code + jit->code_used;
+        emit_prologue(jit);
+
+        struct facts facts;
+
+        memset(&facts, 0, sizeof(facts));
+        facts.cached = NO_REGISTER;
+
+        uint32_t pc = start;
+
+        while (true) {
+                /* The word a block exits at counts as covered too, so
+                 * that a block always covers start to its end. */
+                jit->covered[pc]++;
+
+                if (pc - start == most) {
+                        emit_exit(jit, pc);
+                        break;
+                }
+
+                if (!emit_instruction(jit, &facts, m0->segments[pc], pc)) {
+                        break;
+                }
+                pc++;
+        }
+
+        mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC);
+
+        /* ISO C has no cast from object to function pointer. */
+        block_fn block;
+        memcpy(&block, &entry, sizeof(block));
+
+        jit->blocks[start] = block;
+        jit->ends[start] = pc;
+
+        return block;
+}
+
+/* Purpose: creates a compiler with an empty code buffer
+* Input:    stored -- called with cl and the index of each word of m[0]
+*                     that compiled code stores into
+*           cl -- passed through to stored
+* Output:   the compiler, or NULL if executable memory is unavailable
+*/
+jit_T jit_new(void stored(void *cl, uint32_t index), void *cl)
+{
+        jit_T jit = calloc(1, sizeof(*jit));
+        assert(jit != NULL);
+
+        jit->stored = stored;
+        jit->cl = cl;
+
+        jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (jit->code == MAP_FAILED) {
+                free(jit);
+                return NULL;
+        }
+
+        emit_epilogue(jit);
+
+        if (mprotect(jit->code, CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+                munmap(jit->code, CODE_SIZE);
+                free(jit);
+                return NULL;
+        }
+
+        return jit;
+}
+
+/* Purpose: frees a compiler and its code
+* Input:    jit -- the compiler
+* Output:   none
+*/
+void jit_free(jit_T jit)
+{
+        munmap(jit->code, CODE_SIZE);
+        free(jit->blocks);
+        free(jit->ends);
+        free(jit->counts);
+        free(jit->covered);
+        free(jit);
+}
+
+/* Purpose: throws away all compiled code and sizes the tables for a
+*           new m[0]
+* Input:    jit -- the compiler
+*           program_length -- the length of the new m[0]
+* Output:   none
+*/
+void jit_program(jit_T jit, uint32_t program_length)
+{
+        if (program_length != jit->length) {
+                size_t slots = (size_t)program_length + 1;
+
+                jit->blocks = realloc(jit->blocks, slots * sizeof(block_fn));
+                jit->ends = realloc(jit->ends, slots * sizeof(uint32_t));
+                jit->counts = realloc(jit->counts, slots * sizeof(uint16_t));
+                jit->covered = realloc(jit->covered,
+                                       slots * sizeof(uint16_t));
+                assert(jit->blocks != NULL && jit->ends != NULL &&
+                       jit->counts != NULL && jit->covered != NULL);
+
+                jit->length = program_length;
+        }
+
+        flush(jit);
+}
+
+/* Purpose: forgets the block starting at start, which has to be jumped
+*           to HOT_COUNT times again before it is recompiled
+* Input:    jit -- the compiler
+*           start -- where the block starts
+* Output:   none
+*/
+static void drop_block(jit_T jit, uint32_t start)
+{
+        for (uint32_t i = start; i <= jit->ends[start]; i++) {
+                jit->covered[i]--;
+        }
+
+        jit->blocks[start] = NULL;
+        jit->counts[start] = 0;
+}
+
+/* Purpose: notes a store into m[0], forgetting the blocks that cover the
+*           word stored into
+* Input:    jit -- the compiler
+*           index -- the word stored into
+* Output:   none
+*/
+void jit_store(jit_T jit, uint32_t index)
+{
+        if (index >= jit->length) {
+                return;
+        }
+
+        /* Blocks covering index start at or before it, so going back
+         * from it finds them all before start runs out. */
+        for (uint32_t start = index; jit->covered[index] != 0; start--) {
+                if (jit->blocks[start] != NULL &&
+                    jit->ends[start] >= index) {
+                        drop_block(jit, start);
+                }
+                assert(start > 0 || jit->covered[index] == 0);
+        }
+}
+
+/* Purpose: runs compiled blocks, compiling a block once its start has
+*           been jumped to HOT_COUNT times
+* Input:    jit -- the compiler
+*           memory -- the UM's memory
+*           registers -- the UM's registers
+*           pc -- a jump target in m[0]
+*           executed -- a count of instructions, added to as blocks run
+*           limit -- no block is started once *executed reaches this
+*           preempt -- nor once this is set
+* Output:   the pc at which the interpreter should carry on
+*/
+uint32_t jit_run(jit_T jit, mem_T memory, uint32_t *registers, uint32_t pc,
+                 uint64_t *executed, uint64_t limit,
+                 volatile sig_atomic_t *preempt)
+{
+        seg_T m0 = memory->mapped_ids[0];
+
+        while (pc < jit->length && *executed < limit && !*preempt) {
+                block_fn block = jit->blocks[pc];
+
+                if (block == NULL) {
+                        if (jit->counts[pc] == NEVER ||
+                            ++(jit->counts[pc]) < HOT_COUNT) {
+                                return pc;
+                        }
+                        if (!compilable(m0->segments[pc])) {
+                                jit->counts[pc] = NEVER;
+                                return pc;
+                        }
+                        block = compile_block(jit, m0, pc);
+                }
+
+                uint32_t start = pc;
+                uint64_t result = block(registers, memory);
+                pc = (uint32_t)result;
+
+                /* A block runs straight through to its last word unless it
+                 * hands back the word at pc. */
+                if (result & INTERPRET) {
+                        *executed += pc - start;
+                } else {
+                        *executed += jit->ends[start] - start + 1;
+                }
+
+                for (uint32_t i = 0; i < jit->log_used; i++) {
+                        jit->stored(jit->cl, jit->log[i]);
+                }
+                jit->log_used = 0;
+
+                if (result & INTERPRET) {
+                        return pc;
+                }
+        }
+
+        return pc;
+}
+
+#undef CODE_SIZE
+#undef HOT_COUNT
+#undef NEVER
+#undef MAX_BLOCK
+#undef MAX_INST_BYTES
+#undef LOG_SIZE
+#undef INTERPRET
+#undef RBX
+#undef NO_REGISTER
+#undef EXIT_BYTES
+
+#else
+
+/* Compiling is only supported on x86-64. */
+
+jit_T jit_new(void stored(void *cl, uint32_t index), void *cl)
+{
+        (void)stored;
+        (void)cl;
+        return NULL;
+}
+
+void jit_free(jit_T jit)
+{
+        (void)jit;
+}
+
+void jit_program(jit_T jit, uint32_t program_length)
+{
+        (void)jit;
+        (void)program_length;
+}
+
+void jit_store(jit_T jit, uint32_t index)
+{
+        (void)jit;
+        (void)index;
+}
+
+uint32_t jit_run(jit_T jit, mem_T memory, uint32_t *registers, uint32_t pc,
+                 uint64_t *executed, uint64_t limit,
+                 volatile sig_atomic_t *preempt)
+{
+        (void)jit;
+        (void)memory;
+        (void)registers;
+        (void)executed;
+        (void)limit;
+        (void)preempt;
+        return pc;
+}
+
+#endif
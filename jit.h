@@ -0,0 +1,51 @@
+/********************************************************************
+ *
+ *                     jit.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Interface for the jit module. Compiles hot basic blocks of
+ *     m[0] to x86-64 code and runs them for "um --jit". A block
+ *     starts where Load Program jumps to and ends at the next Load
+ *     Program; anything the compiled code can't do on its own
+ *     (halt, map, unmap, I/O, storing into m[0] or into a shared
+ *     segment) hands control back to the interpreter.
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include "memory_segment.h"
+
+#ifndef JIT
+#define JIT
+
+typedef struct jit_T *jit_T;
+
+/* Creates a compiler, or returns NULL where compiling isn't supported.
+ * stored is called back with cl after compiled code stores into m[0]. */
+jit_T jit_new(void stored(void *cl, uint32_t index), void *cl);
+
+/* Frees a compiler and its code. */
+void jit_free(jit_T jit);
+
+/* Throws away all compiled code; called when m[0] is replaced. */
+void jit_program(jit_T jit, uint32_t program_length);
+
+/* Notes a store into m[0] at index, discarding code compiled from it. */
+void jit_store(jit_T jit, uint32_t index);
+
+/* Runs compiled blocks from pc for as long as there are any, *executed
+ * is below limit and *preempt is clear, adding the instructions they run
+ * to *executed. Returns the pc at which the interpreter should carry on. */
+uint32_t jit_run(jit_T jit, mem_T memory, uint32_t *registers, uint32_t pc,
+                 uint64_t *executed, uint64_t limit,
+                 volatile sig_atomic_t *preempt);
+
+#endif
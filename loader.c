@@ -0,0 +1,194 @@
+/********************************************************************
+ *
+ *                     loader.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *     
+ *     Implementation for the loader module. The program file is
+ *     mapped into memory and its big-endian words are byte-swapped
+ *     straight into m[0], 32 or 16 bytes at a time when the CPU
+ *     has AVX2 or SSSE3.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "loader.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define WORD_BYTES 4
+
+/* Purpose: byte-swaps words one at a time; also finishes off whatever
+*           the vector kernels leave over
+* Input:    words -- where the host words go
+*           bytes -- big-endian words, not necessarily aligned
+*           num_words -- how many words to convert
+* Output:   none
+*/
+static void swap_words_scalar(uint32_t *words, const unsigned char *bytes,
+                              size_t num_words)
+{
+        for (size_t i = 0; i < num_words; i++) {
+                const unsigned char *b = bytes + i * WORD_BYTES;
+
+                words[i] = ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) |
+                           ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+        }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Purpose: byte-swaps four words per pshufb
+* Input:    as for swap_words_scalar
+* Output:   none
+*/
+__attribute__((target("ssse3")))
+static void swap_words_ssse3(uint32_t *words, const unsigned char *bytes,
+                             size_t num_words)
+{
+        const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                            11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i = 0;
+
+        for (; i + 4 <= num_words; i += 4) {
+                __m128i v = _mm_loadu_si128((const __m128i *)
+                                            (bytes + i * WORD_BYTES));
+                _mm_storeu_si128((__m128i *)(words + i),
+                                 _mm_shuffle_epi8(v, order));
+        }
+
+        swap_words_scalar(words + i, bytes + i * WORD_BYTES, num_words - i);
+}
+
+/* Purpose: byte-swaps eight words per vpshufb
+* Input:    as for swap_words_scalar
+* Output:   none
+*/
+__attribute__((target("avx2")))
+static void swap_words_avx2(uint32_t *words, const unsigned char *bytes,
+                            size_t num_words)
+{
+        const __m256i order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                               11, 10, 9, 8, 15, 14, 13, 12,
+                                               3, 2, 1, 0, 7, 6, 5, 4,
+                                               11, 10, 9, 8, 15, 14, 13, 12);
+        size_t i = 0;
+
+        for (; i + 8 <= num_words; i += 8) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)
+                                               (bytes + i * WORD_BYTES));
+                _mm256_storeu_si256((__m256i *)(words + i),
+                                    _mm256_shuffle_epi8(v, order));
+        }
+
+        swap_words_scalar(words + i, bytes + i * WORD_BYTES, num_words - i);
+}
+
+#endif
+
+/* Purpose: converts big-endian words into host words with the widest
+*           kernel this CPU supports
+* Input:    words -- where the host words go
+*           bytes -- big-endian words, not necessarily aligned
+*           num_words -- how many words to convert
+* Output:   none
+*/
+void swap_words(uint32_t *words, const unsigned char *bytes, 
+                size_t num_words)
+{
+#ifdef HAVE_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) {
+                swap_words_avx2(words, bytes, num_words);
+                return;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+                swap_words_ssse3(words, bytes, num_words);
+                return;
+        }
+#endif
+        swap_words_scalar(words, bytes, num_words);
+}
+
+/* Purpose: maps m[0] in an empty memory and fills it from a program
+*           file. A file whose length is not a multiple of four gets a
+*           final word made of its last bytes, high-order first, with
+*           the missing low-order bytes zero, and a warning.
+* Input:    memory -- a memory with nothing mapped yet
+*           path -- the program file
+* Output:   false (with a message on stderr) if the file can't be read
+*/
+bool load_program_file(mem_T memory, const char *path)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                perror(path);
+                return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+                perror(path);
+                close(fd);
+                return false;
+        }
+
+        size_t size = info.st_size;
+        size_t full_words = size / WORD_BYTES;
+        size_t extra_bytes = size % WORD_BYTES;
+
+        if (full_words + (extra_bytes != 0) > UINT32_MAX) {
+                fprintf(stderr, "%s: program too large\n", path);
+                close(fd);
+                return false;
+        }
+
+        const unsigned char *bytes = NULL;
+
+        if (size > 0) {
+                bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (bytes == MAP_FAILED) {
+                        perror(path);
+                        close(fd);
+                        return false;
+                }
+                madvise((void *)bytes, size, MADV_SEQUENTIAL);
+        }
+
+        /* The first segment mapped in a new memory is m[0]. */
+        uint32_t id = map_segment(memory, full_words + (extra_bytes != 0));
+        assert(id == 0);
+
+        uint32_t *m0 = memory->mapped_ids[0]->segments;
+        swap_words(m0, bytes, full_words);
+
+        if (extra_bytes != 0) {
+                fprintf(stderr, "%s: warning: %zu trailing byte%s padded "
+                        "to a full word\n", path, extra_bytes,
+                        extra_bytes == 1 ? "" : "s");
+
+                unsigned char last[WORD_BYTES] = { 0 };
+                memcpy(last, bytes + full_words * WORD_BYTES, extra_bytes);
+                swap_words_scalar(&m0[full_words], last, 1);
+        }
+
+        if (size > 0) {
+                munmap((void *)bytes, size);
+        }
+        close(fd);
+
+        return true;
+}
+
+#undef WORD_BYTES
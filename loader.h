@@ -0,0 +1,31 @@
+/********************************************************************
+ *
+ *                     loader.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *     
+ *     Interface for the loader module. Reads a UM program file
+ *     into m[0] of a fresh memory.
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory_segment.h"
+
+#ifndef LOADER
+#define LOADER
+
+/* Maps m[0] in an empty memory and fills it from a program file. */
+bool load_program_file(mem_T memory, const char *path);
+
+/* Converts big-endian words from a file into host words. */
+void swap_words(uint32_t *words, const unsigned char *bytes, 
+                size_t num_words);
+
+#endif
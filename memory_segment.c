@@ -16,21 +16,256 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
-#include <mem.h>
-#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "memory_segment.h"
 
-#define HINT 100
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-struct mem_T {
-        Seq_T mapped_ids;
-        Seq_T unmapped_ids;
-};
+#define INITIAL_IDS 128
+#define MIN_CLASS_WORDS 4
+#define PAGE_BYTES 4096
 
-struct seg_T {
-        uint32_t *segments; 
-        int seg_length;
-};
+/* Purpose: finds the smallest size class that can hold a segment
+* Input:    num_words -- the length of the segment
+* Output:   the size class, or NUM_SIZE_CLASSES or more if the segment
+*           is too large for any class
+*/
+static inline unsigned size_class_of(uint32_t num_words)
+{
+        if (num_words <= MIN_CLASS_WORDS) {
+                return 0;
+        }
+
+        /* log2 of num_words rounded up to a power of two, less log2(4) */
+        return 32 - __builtin_clz(num_words - 1) - 2;
+}
+
+/* Purpose: zeroes the words of a recycled block, sixteen bytes per
+*           store. Blocks hold a multiple of four words, so rounding
+*           the length up never runs past the end of the block.
+* Input:    words -- the start of the block's payload, 16-byte aligned
+*           num_words -- the number of words that must be zero
+* Output:   none
+*/
+static inline void zero_words(uint32_t *words, uint32_t num_words)
+{
+        uint32_t num_blocks = (num_words + MIN_CLASS_WORDS - 1) / 
+                              MIN_CLASS_WORDS;
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i *block = (__m128i *)words;
+
+        for (uint32_t i = 0; i < num_blocks; i++) {
+                _mm_store_si128(&block[i], zero);
+        }
+#else
+        memset(words, 0, num_blocks * MIN_CLASS_WORDS * sizeof(*words));
+#endif
+}
+
+/* Purpose: finds the histogram bucket for a segment length
+* Input:    num_words -- the length of the segment
+* Output:   its size class, or NUM_SIZE_CLASSES if it has none
+*/
+static inline unsigned bucket_of(uint32_t num_words)
+{
+        unsigned size_class = size_class_of(num_words);
+
+        return (size_class < NUM_SIZE_CLASSES) ? size_class 
+                                               : NUM_SIZE_CLASSES;
+}
+
+/* Purpose: counts a segment that memory now holds
+* Input:    mem_segments -- our memory struct
+*           num_words -- the length of the segment
+* Output:   none
+*/
+static inline void count_held(mem_T mem_segments, uint32_t num_words)
+{
+        mem_segments->live_words += num_words;
+        mem_segments->live_segments++;
+        mem_segments->class_live[bucket_of(num_words)]++;
+
+        if (mem_segments->live_words > mem_segments->peak_words) {
+                mem_segments->peak_words = mem_segments->live_words;
+        }
+        if (mem_segments->live_segments > mem_segments->peak_segments) {
+                mem_segments->peak_segments = mem_segments->live_segments;
+        }
+}
+
+/* Purpose: finds the size of the mapping behind a large segment
+* Input:    num_words -- the length of the segment
+* Output:   its header and words, rounded up to whole pages
+*/
+static inline size_t mapping_bytes(uint32_t num_words)
+{
+        size_t bytes = sizeof(struct seg_T) + 
+                       (size_t)num_words * sizeof(uint32_t);
+
+        return (bytes + PAGE_BYTES - 1) & ~(size_t)(PAGE_BYTES - 1);
+}
+
+/* Purpose: gets a large segment its own anonymous mapping, reusing one
+*           kept from an earlier segment of the same size if there is
+*           one. Only the header's page of a kept mapping still holds
+*           anything, so only that page needs zeroing.
+* Input:    mem_segments -- our memory struct
+*           num_words -- the length of the segment
+* Output:   the segment, zero-filled
+*/
+static seg_T allocate_large(mem_T mem_segments, uint32_t num_words)
+{
+        size_t bytes = mapping_bytes(num_words);
+
+        for (uint32_t i = 0; i < mem_segments->num_retained; i++) {
+                seg_T segment = mem_segments->retained[i];
+
+                if (mapping_bytes(segment->seg_length) == bytes) {
+                        mem_segments->retained[i] = mem_segments->retained[
+                                        --(mem_segments->num_retained)];
+
+                        size_t first_page = (PAGE_BYTES - 
+                                             sizeof(struct seg_T)) /
+                                            sizeof(uint32_t);
+                        memset(segment->segments, 0, 
+                               (num_words < first_page ? num_words 
+                                                       : first_page) *
+                               sizeof(uint32_t));
+                        return segment;
+                }
+        }
+
+        seg_T segment = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(segment != MAP_FAILED);
+
+        return segment;
+}
+
+/* Purpose: gives a large segment's pages back to the system, keeping
+*           the mapping itself for reuse while there is room
+* Input:    mem_segments -- our memory struct
+*           segment -- a large segment no identifier refers to
+* Output:   none
+*/
+static void release_large(mem_T mem_segments, seg_T segment)
+{
+        size_t bytes = mapping_bytes(segment->seg_length);
+
+        if (mem_segments->num_retained == MAX_RETAINED_MAPPINGS) {
+                munmap(segment, bytes);
+                return;
+        }
+
+        /* The header's page stays so the mapping's size is remembered. */
+        if (bytes > PAGE_BYTES) {
+                madvise((char *)segment + PAGE_BYTES, bytes - PAGE_BYTES,
+                        MADV_DONTNEED);
+        }
+        mem_segments->retained[mem_segments->num_retained++] = segment;
+}
+
+/* Purpose: allocates a zero-filled segment, from its size class's free
+*           list when a block is waiting there
+* Input:    mem_segments -- our memory struct
+*           num_words -- the length of the segment
+* Output:   the new segment, with a single reference
+*/
+static seg_T allocate_segment(mem_T mem_segments, uint32_t num_words)
+{
+        unsigned size_class = size_class_of(num_words);
+        seg_T segment;
+
+        if (num_words >= mem_segments->mmap_words) {
+                segment = allocate_large(mem_segments, num_words);
+        } else if (size_class < NUM_SIZE_CLASSES && 
+            mem_segments->free_blocks[size_class] != NULL) {
+                segment = mem_segments->free_blocks[size_class];
+                mem_segments->free_blocks[size_class] = segment->next_free;
+
+                zero_words(segment->segments, num_words);
+        } else {
+                size_t capacity = num_words;
+
+                if (size_class < NUM_SIZE_CLASSES) {
+                        capacity = (size_t)MIN_CLASS_WORDS << size_class;
+                }
+
+                segment = calloc(1, sizeof(*segment) + 
+                                    capacity * sizeof(uint32_t));
+                assert(segment != NULL);
+        }
+
+        segment->next_free = NULL;
+        segment->seg_length = num_words;
+        segment->refs = 1;
+
+        count_held(mem_segments, num_words);
+
+        return segment;
+}
+
+/* Purpose: drops one identifier's reference to a segment. A segment no
+*           identifier refers to goes back on its size class's free
+*           list, or to the system if it has no size class; a segment
+*           with a mapping of its own has its pages handed back.
+* Input:    mem_segments -- our memory struct
+*           segment -- the segment being released
+* Output:   none
+*/
+static inline void release_segment(mem_T mem_segments, seg_T segment)
+{
+        if (--(segment->refs) != 0) {
+                return;
+        }
+
+        mem_segments->live_words -= segment->seg_length;
+        mem_segments->live_segments--;
+        mem_segments->class_live[bucket_of(segment->seg_length)]--;
+
+        /* Snapshot pages go when the whole mapping does. */
+        if ((uintptr_t)segment - (uintptr_t)mem_segments->borrowed <
+            mem_segments->borrowed_length) {
+                return;
+        }
+
+        if (segment->seg_length >= mem_segments->mmap_words) {
+                release_large(mem_segments, segment);
+                return;
+        }
+
+        unsigned size_class = size_class_of(segment->seg_length);
+
+        if (size_class < NUM_SIZE_CLASSES) {
+                segment->next_free = mem_segments->free_blocks[size_class];
+                mem_segments->free_blocks[size_class] = segment;
+        } else {
+                free(segment);
+        }
+}
+
+/* Purpose: pushes an identifier onto the stack of unmapped ids
+* Input:    mem_segments -- our memory struct
+*           id -- the identifier that was just unmapped
+* Output:   none
+*/
+static inline void push_unmapped(mem_T mem_segments, uint32_t id)
+{
+        if (mem_segments->unmapped_used == mem_segments->unmapped_length) {
+                mem_segments->unmapped_length *= 2;
+                mem_segments->unmapped_ids = realloc(
+                        mem_segments->unmapped_ids,
+                        mem_segments->unmapped_length * sizeof(uint32_t));
+                assert(mem_segments->unmapped_ids != NULL);
+        }
+
+        mem_segments->unmapped_ids[mem_segments->unmapped_used++] = id;
+}
 
 /* Purpose: To create an instance of our memory struct
 * Input: none
@@ -38,129 +273,196 @@ struct seg_T {
 */
 mem_T mem_new() 
 {
-        mem_T memory = malloc(sizeof(*memory));
-        memory->mapped_ids = Seq_new(HINT);
-        memory->unmapped_ids = Seq_new(HINT);
+        mem_T memory = calloc(1, sizeof(*memory));
+        assert(memory != NULL);
+
+        memory->mapped_used = 0;
+        memory->next_id = 0;
+        memory->mapped_length = INITIAL_IDS;
+        memory->mapped_ids = calloc(memory->mapped_length, sizeof(seg_T));
+        assert(memory->mapped_ids != NULL);
+
+        memory->mmap_words = MMAP_THRESHOLD_WORDS;
+
+        memory->unmapped_used = 0;
+        memory->unmapped_length = INITIAL_IDS;
+        memory->unmapped_ids = malloc(memory->unmapped_length * 
+                                      sizeof(uint32_t));
+        assert(memory->unmapped_ids != NULL);
 
         return memory;
 }
 
 /* Purpose: To free all heap allocated memory from memory struct
-* Input: mem_segments -- the memory struct containing our sequences
+* Input: mem_segments -- the memory struct containing our segments
 * Output: none
 */
 void mem_free(mem_T mem_segments) 
 {
-        uint32_t length = Seq_length(mem_segments->mapped_ids);
-        
-        /* Frees the array of words inside the memory segment. */
-        for (uint32_t i = 0; i < length; i++) {
-            if (Seq_get(mem_segments->mapped_ids, i) != NULL) {
-                seg_T delete_segment = Seq_get(mem_segments->mapped_ids, i);
+        /* Frees every mapped segment, then every recycled block. */
+        for (uint64_t i = 0; i < mem_segments->next_id; i++) {
+                seg_T segment = segment_at(mem_segments, i);
+
+                if (segment != NULL) {
+                        release_segment(mem_segments, segment);
+                }
+        }
+
+        for (unsigned c = 0; c < NUM_SIZE_CLASSES; c++) {
+                seg_T block = mem_segments->free_blocks[c];
 
-                free(delete_segment->segments);
-                free(delete_segment);
-            }
+                while (block != NULL) {
+                        seg_T next = block->next_free;
+                        free(block);
+                        block = next;
+                }
         }
 
-        Seq_free(&(mem_segments->mapped_ids));
-        Seq_free(&(mem_segments->unmapped_ids));
+        for (uint32_t i = 0; i < mem_segments->num_retained; i++) {
+                seg_T segment = mem_segments->retained[i];
+                munmap(segment, mapping_bytes(segment->seg_length));
+        }
+
+        free(mem_segments->unmapped_ids);
+        for (uint32_t p = 0; p < mem_segments->num_id_pages; p++) {
+                free(mem_segments->id_pages[p]);
+        }
+
+        free(mem_segments->id_pages);
+        free(mem_segments->mapped_ids);
+
+        if (mem_segments->borrowed != NULL) {
+                munmap(mem_segments->borrowed, mem_segments->borrowed_length);
+        }
         free(mem_segments);
 }
 
+/* Purpose: makes room in the table for the identifier at the
+*           high-water mark, doubling the flat table while it is below
+*           MAX_FLAT_IDS and adding a page past that
+* Input:    mem_segments -- our memory struct
+*           id -- the identifier about to be handed out for the first time
+* Output:   none
+*/
+static void grow_table(mem_T mem_segments, uint32_t id)
+{
+        if (id < MAX_FLAT_IDS) {
+                uint32_t old_length = mem_segments->mapped_length;
+
+                mem_segments->mapped_length = old_length * 2;
+                mem_segments->mapped_ids = realloc(mem_segments->mapped_ids,
+                                mem_segments->mapped_length * sizeof(seg_T));
+                assert(mem_segments->mapped_ids != NULL);
+
+                memset(mem_segments->mapped_ids + old_length, 0,
+                       old_length * sizeof(seg_T));
+                return;
+        }
+
+        uint32_t page = (id - MAX_FLAT_IDS) >> ID_PAGE_BITS;
+
+        if ((page & (page - 1)) == 0) {
+                /* the page directory doubles whenever it fills */
+                mem_segments->id_pages = realloc(mem_segments->id_pages,
+                                (page == 0 ? 1 : page * 2) * sizeof(seg_T *));
+                assert(mem_segments->id_pages != NULL);
+        }
+
+        mem_segments->id_pages[page] = calloc((size_t)1 << ID_PAGE_BITS,
+                                              sizeof(seg_T));
+        assert(mem_segments->id_pages[page] != NULL);
+
+        mem_segments->num_id_pages = page + 1;
+}
+
 /* Purpose: To map a segment of memory
-* Input: mem_segments -- our memory struct containing our sequences
+* Input: mem_segments -- our memory struct containing our segments
 *        num_words -- the size of the memory segment 
-* Output: none
+* Output: the identifier of the new segment
 * It is a checked runtime error to try to map more than 2^32 segments.
 */
 uint32_t map_segment(mem_T mem_segments, uint32_t num_words)
 {
-        seg_T new_segment = malloc(sizeof(*new_segment));
-        assert(new_segment != NULL);
-
-        uint32_t *new_seg = calloc((num_words), sizeof(new_seg));
-        assert(new_seg != NULL);
-
-        new_segment->segments = new_seg;
-        new_segment->seg_length = num_words;
-
+        seg_T new_segment = allocate_segment(mem_segments, num_words);
         uint32_t new_id;
         
         /* Attempts to reuse an unmapped segment identifier. */
-        if (Seq_length(mem_segments->unmapped_ids) != 0) {
-                new_id = (uint32_t)(uintptr_t)
-                         Seq_remlo(mem_segments->unmapped_ids);
-
-                Seq_put(mem_segments->mapped_ids, new_id, new_segment);
+        if (mem_segments->unmapped_used != 0) {
+                new_id = mem_segments->unmapped_ids[
+                                        --(mem_segments->unmapped_used)];
         } else {
-                new_id = Seq_length(mem_segments->mapped_ids);
-
-                Seq_addhi(mem_segments->mapped_ids, new_segment);
+                assert(mem_segments->next_id <= UINT32_MAX);
+                new_id = mem_segments->next_id++;
+
+                /* Slots are added a whole table or page at a time. */
+                if (new_id == mem_segments->mapped_length || 
+                    (new_id > MAX_FLAT_IDS && 
+                     ((new_id - MAX_FLAT_IDS) & 
+                      ((1u << ID_PAGE_BITS) - 1)) == 0)) {
+                        grow_table(mem_segments, new_id);
+                }
         }
 
+        *segment_slot(mem_segments, new_id) = new_segment;
+        mem_segments->mapped_used++;
+        mem_segments->maps++;
+        mem_segments->class_maps[bucket_of(num_words)]++;
+
         return new_id;
 }
 
 /* Purpose: To unmap a segment of memory
-* Input: mem_segments -- our memory struct containing our sequences
+* Input: mem_segments -- our memory struct containing our segments
 *        id -- the memory segment's identifier
 * Output: none
 */
 void unmap_segment(mem_T mem_segments, uint32_t id)
 {
-        seg_T delete_segment = Seq_get(mem_segments->mapped_ids, id);
-        assert(delete_segment != NULL);
+        seg_T *slot = segment_slot(mem_segments, id);
+        assert(*slot != NULL);
 
-        free(delete_segment->segments);
-        free(delete_segment);
+        release_segment(mem_segments, *slot);
         
-        Seq_put(mem_segments->mapped_ids, id, NULL);
-        Seq_addlo(mem_segments->unmapped_ids, (void *)(uintptr_t)id);
+        *slot = NULL;
+        mem_segments->mapped_used--;
+        mem_segments->unmaps++;
+
+        push_unmapped(mem_segments, id);
 }
 
 /* Purpose: Creates the program m[0] and adds it to mapped ids
-* Input: mem_segments -- our memory struct containing our sequences
-*        instructions -- the stream of instructions for the UM
+* Input: mem_segments -- our memory struct, with nothing yet mapped
+*        instructions -- the instructions for the UM, in order
+*        num_words -- the number of instructions
 * Output: none
 */
-void initalize_program(mem_T mem_segments, Seq_T instructions)
+void initalize_program(mem_T mem_segments, const uint32_t *instructions,
+                       uint32_t num_words)
 {
-        seg_T program = malloc(sizeof(*program));
-        assert(program != NULL);
-        
-        uint32_t *m0 = calloc(Seq_length(instructions), sizeof(m0));
-        assert(m0 != NULL);
-
-
-        /* Copy the instructions from the stream of instructions into the 
-         * program. */
-        for (int i = 0; i < Seq_length(instructions); i++) {
-                m0[i] = (uint32_t)(uintptr_t)Seq_get(instructions, i);
-        }
+        uint32_t id = map_segment(mem_segments, num_words);
+        assert(id == 0);
 
-        program->segments = m0;
-        program->seg_length = Seq_length(instructions);
-
-        Seq_addhi(mem_segments->mapped_ids, program);
+        /* Copy the instructions into the program. */
+        memcpy(mem_segments->mapped_ids[0]->segments, instructions, 
+               num_words * sizeof(uint32_t));
 }
 
 /* Purpose: loads a value from a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
+* Input: mem_segments -- our memory struct containing our segments
 *                  id -- the memory segment identifier
 *                  index -- the index within the memory segment
 * Output: the value stored in the memory segment
 */
 uint32_t segmented_load(mem_T mem_segments, uint32_t id, uint32_t index)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
+        seg_T segment = segment_at(mem_segments, id);
         assert(segment != NULL);
 
         return segment->segments[index];
 }
 
 /* Purpose: stores a value into a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
+* Input: mem_segments -- our memory struct containing our segments
 *                  id -- the memory segment identifier
 *                  index -- the index within the memory segment
 *                  word -- value to store
@@ -169,58 +471,296 @@ uint32_t segmented_load(mem_T mem_segments, uint32_t id, uint32_t index)
 void segmented_store(mem_T mem_segments, uint32_t id, uint32_t index, 
                      uint32_t word)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
+        seg_T segment = segment_at(mem_segments, id);
         assert(segment != NULL);
 
+        if (segment->refs > 1) {
+                segment = unshare_segment(mem_segments, id);
+        }
+
         segment->segments[index] = word;
 }
 
-/* Purpose: loads a new program m[0] from a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
+/* Purpose: gives an identifier its own copy of a segment it shares
+*           with another identifier, ahead of a store into it
+* Input: mem_segments -- our memory struct containing our segments
+*                  id -- the identifier whose segment is shared
+* Output: the private copy now mapped at id
+*/
+seg_T unshare_segment(mem_T mem_segments, uint32_t id)
+{
+        seg_T *slot = segment_slot(mem_segments, id);
+        seg_T shared = *slot;
+        seg_T copy = allocate_segment(mem_segments, shared->seg_length);
+
+        memcpy(copy->segments, shared->segments, 
+               shared->seg_length * sizeof(uint32_t));
+
+        shared->refs--;
+        *slot = copy;
+
+        return copy;
+}
+
+/* Purpose: loads a new program m[0] from a memory segment. The segment
+*          is shared with m[0] rather than copied; whichever side is
+*          stored into first gets its own copy.
+* Input: mem_segments -- our memory struct containing our segments
 *                  id -- the memory segment identifier
-* Output: None
+* Output: true if m[0] changed, false if it already was that segment
 * Effects: changes the running program
 */
-void load_program(mem_T mem_segments, uint32_t id)
+bool load_program(mem_T mem_segments, uint32_t id)
 {
-        if (id == 0) {
-                return;
-        }
+        seg_T segment = segment_at(mem_segments, id);
 
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        
-        unmap_segment(mem_segments, 0);
+        if (segment == mem_segments->mapped_ids[0]) {
+                return false;
+        }
 
-        uint32_t new_id = map_segment(mem_segments, segment->seg_length);
-        seg_T new_m0 = Seq_get(mem_segments->mapped_ids, new_id);
+        release_segment(mem_segments, mem_segments->mapped_ids[0]);
+        segment->refs++;
+        mem_segments->mapped_ids[0] = segment;
 
-        /* Copy the instructions from segment into the new program. */
-        for (int i = 0; i < segment->seg_length; i++) {
-                new_m0->segments[i] = segment->segments[i];
-        }
+        return true;
 }
 
 /* Purpose: gets the length of a segment in memory
-* Input: mem_segments -- our memory struct containing our sequences
+* Input: mem_segments -- our memory struct containing our segments
 *                  id -- the memory segment identifier
 * Output: the length of the memory segment
 */
 uint32_t segment_length(mem_T mem_segments, uint32_t id)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        return segment->seg_length;
+        return segment_at(mem_segments, id)->seg_length;
 }
 
 /* Purpose: gets the word stored in a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
+* Input: mem_segments -- our memory struct containing our segments
 *                  id -- the memory segment identifier
 *               index -- the index within the memory segment
 * Output: the word stored in the memory segment
 */
 uint32_t segment_word(mem_T mem_segments, uint32_t id, int index)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        return segment->segments[index];
+        return segment_at(mem_segments, id)->segments[index];
+}
+
+/* Purpose: sets the length from which segments are given anonymous
+*          mappings of their own
+* Input: mem_segments -- our memory struct, with nothing mapped yet
+*           num_words -- the new threshold
+* Output: none
+*/
+void mem_mmap_threshold(mem_T mem_segments, uint32_t num_words)
+{
+        assert(mem_segments->next_id == 0);
+
+        mem_segments->mmap_words = num_words;
+}
+
+/* Purpose: grows the table until it has a slot for an identifier,
+*           the same way handing out identifiers in order would
+* Input:    mem_segments -- our memory struct
+*           id -- the identifier
+* Output:   none
+*/
+static void cover_id(mem_T mem_segments, uint32_t id)
+{
+        while (true) {
+                uint64_t covered = mem_segments->mapped_length;
+
+                if (mem_segments->mapped_length >= MAX_FLAT_IDS) {
+                        covered = MAX_FLAT_IDS + ((uint64_t)mem_segments->
+                                        num_id_pages << ID_PAGE_BITS);
+                }
+                if (id < covered) {
+                        return;
+                }
+
+                grow_table(mem_segments, covered);
+        }
+}
+
+/* Purpose: maps a segment read back from a snapshot
+* Input: mem_segments -- our memory struct
+*                  id -- the identifier it was mapped at
+*             segment -- the segment, its reference count as saved
+* Output: none
+*/
+void restore_segment(mem_T mem_segments, uint32_t id, seg_T segment)
+{
+        cover_id(mem_segments, id);
+
+        /* A segment shared with m[0] is held once. */
+        if (id == 0 || segment != mem_segments->mapped_ids[0]) {
+                count_held(mem_segments, segment->seg_length);
+        }
+
+        *segment_slot(mem_segments, id) = segment;
+        mem_segments->mapped_used++;
+}
+
+/* Purpose: sets the identifier high-water mark and the stack of unmapped
+*          identifiers after a snapshot's segments have been restored
+* Input: mem_segments -- our memory struct
+*             next_id -- the first identifier never handed out
+*            unmapped -- the unmapped identifiers, bottom of the stack first
+*        num_unmapped -- how many there are
+* Output: none
+*/
+void restore_ids(mem_T mem_segments, uint64_t next_id,
+                 const uint32_t *unmapped, uint32_t num_unmapped)
+{
+        if (next_id > 0) {
+                cover_id(mem_segments, next_id - 1);
+        }
+        mem_segments->next_id = next_id;
+
+        while (mem_segments->unmapped_length < num_unmapped) {
+                mem_segments->unmapped_length *= 2;
+        }
+        mem_segments->unmapped_ids = realloc(mem_segments->unmapped_ids,
+                        mem_segments->unmapped_length * sizeof(uint32_t));
+        assert(mem_segments->unmapped_ids != NULL);
+
+        memcpy(mem_segments->unmapped_ids, unmapped, 
+               num_unmapped * sizeof(uint32_t));
+        mem_segments->unmapped_used = num_unmapped;
+}
+
+/* Purpose: hands memory the mapping that restored segments point into.
+*          Segments inside it are never freed or recycled, and the
+*          mapping is unmapped by mem_free.
+* Input: mem_segments -- our memory struct
+*               start -- the start of the mapping
+*              length -- its length in bytes
+* Output: none
+*/
+void mem_borrow(mem_T mem_segments, void *start, size_t length)
+{
+        assert(mem_segments->borrowed == NULL);
+
+        mem_segments->borrowed = start;
+        mem_segments->borrowed_length = length;
+}
+
+/*
+ * mem_report builds its text by hand: stdio isn't safe in a signal
+ * handler, and the report must be written from one.
+ */
+#define REPORT_BYTES 4096
+
+/* Purpose: appends a string to the report
+* Input:    report, used -- the report and how much of it is written
+*           text -- the string
+* Output:   none
+*/
+static void append_text(char *report, size_t *used, const char *text)
+{
+        while (*text != '\0' && *used < REPORT_BYTES) {
+                report[(*used)++] = *text++;
+        }
+}
+
+/* Purpose: appends a number to the report, right-aligned
+* Input:    report, used -- the report and how much of it is written
+*           value -- the number
+*           width -- the least number of characters to take up
+* Output:   none
+*/
+static void append_number(char *report, size_t *used, uint64_t value,
+                          int width)
+{
+        char digits[24];
+        int num_digits = 0;
+
+        do {
+                digits[num_digits++] = '0' + value % 10;
+                value /= 10;
+        } while (value != 0);
+
+        for (int i = num_digits; i < width; i++) {
+                append_text(report, used, " ");
+        }
+        while (num_digits > 0) {
+                char digit[2] = { digits[--num_digits], '\0' };
+                append_text(report, used, digit);
+        }
+}
+
+/* Purpose: appends one "name  value" line to the report
+* Input:    report, used -- the report and how much of it is written
+*           name -- what the value is
+*           value -- the value
+* Output:   none
+*/
+static void append_line(char *report, size_t *used, const char *name,
+                        uint64_t value)
+{
+        append_text(report, used, name);
+        append_number(report, used, value, 32 - (int)strlen(name));
+        append_text(report, used, "\n");
+}
+
+/* Purpose: writes the usage counters, using nothing but write(2)
+* Input: mem_segments -- our memory struct
+*                  fd -- where to write
+*          elapsed_ms -- how long the machine has run, for the rates
+* Output: none
+*/
+void mem_report(mem_T mem_segments, int fd, uint64_t elapsed_ms)
+{
+        char report[REPORT_BYTES];
+        size_t used = 0;
+        uint64_t ms = (elapsed_ms != 0) ? elapsed_ms : 1;
+
+        append_text(report, &used, "== UM memory ==\n");
+        append_line(report, &used, "live segments", 
+                     mem_segments->live_segments);
+        append_line(report, &used, "live words", mem_segments->live_words);
+        append_line(report, &used, "peak segments", 
+                     mem_segments->peak_segments);
+        append_line(report, &used, "peak words", mem_segments->peak_words);
+        append_line(report, &used, "mapped ids", mem_segments->mapped_used);
+        append_line(report, &used, "id high-water mark", 
+                     mem_segments->next_id);
+        append_line(report, &used, "maps", mem_segments->maps);
+        append_line(report, &used, "unmaps", mem_segments->unmaps);
+        append_line(report, &used, "elapsed ms", elapsed_ms);
+        append_line(report, &used, "maps per second", 
+                     mem_segments->maps * 1000 / ms);
+        append_line(report, &used, "unmaps per second",
+                     mem_segments->unmaps * 1000 / ms);
+
+        append_text(report, &used, "size class (words)              "
+                                   "maps           live\n");
+        for (unsigned c = 0; c <= NUM_SIZE_CLASSES; c++) {
+                if (c < NUM_SIZE_CLASSES) {
+                        append_text(report, &used, "  <= ");
+                        append_number(report, &used, 
+                                      (uint64_t)MIN_CLASS_WORDS << c, 10);
+                } else {
+                        append_text(report, &used, "  larger       ");
+                }
+                append_number(report, &used, mem_segments->class_maps[c], 
+                              21);
+                append_number(report, &used, mem_segments->class_live[c], 
+                              15);
+                append_text(report, &used, "\n");
+        }
+
+        for (size_t written = 0; written < used; ) {
+                ssize_t n = write(fd, report + written, used - written);
+
+                if (n <= 0) {
+                        break;
+                }
+                written += n;
+        }
 }
 
-#undef HINT
+#undef REPORT_BYTES
+#undef INITIAL_IDS
+#undef MIN_CLASS_WORDS
+#undef PAGE_BYTES
@@ -11,19 +11,134 @@
  *     Interface for memory_segment.h module. Contains functions
  *     that manage the memory segments, both mapped and unmapped,
  *     the memory. 
+ *
+ *     The structs are visible so that the run loop in um_driver.c
+ *     can index segments directly; everything that maps, unmaps or
+ *     shares segments goes through the functions below.
  ********************************************************************/
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
-#include <seq.h>
+#include <stdbool.h>
 
 #ifndef MEMORY_SEGMENTS
 #define MEMORY_SEGMENTS
 
+/*
+ * Segments are carved from power-of-two size classes holding
+ * 4, 8, ..., 4 << (NUM_SIZE_CLASSES - 1) words. Larger segments are
+ * allocated on their own and returned to the system when unmapped.
+ */
+#define NUM_SIZE_CLASSES 16
+
+/*
+ * Segments of at least this many words get an anonymous mapping of their
+ * own, so the kernel zeroes pages as they are first touched rather than
+ * all at map time. A few such mappings are kept after they are unmapped,
+ * with their pages handed back, for the next segment of the same size.
+ */
+#define MMAP_THRESHOLD_WORDS (1u << 16)
+#define MAX_RETAINED_MAPPINGS 8
+
 typedef struct mem_T *mem_T;
 typedef struct seg_T *seg_T;
 
+/*
+ * A segment header sits directly in front of its words, so one
+ * allocation serves both. A segment may be mapped under more than one
+ * identifier after Load Program shares it with m[0]; refs counts those
+ * identifiers, and a shared segment is copied before it is stored into.
+ */
+struct seg_T {
+        seg_T next_free;
+        uint32_t seg_length;
+        uint32_t refs;
+        uint32_t segments[];
+};
+
+/*
+ * Segment identifiers below MAX_FLAT_IDS index one contiguous table that
+ * doubles as it fills. Identifiers past it live in pages of
+ * 1 << ID_PAGE_BITS slots, allocated as the high-water mark reaches them,
+ * so a program with millions of segments never reallocates one huge
+ * table.
+ */
+#define MAX_FLAT_IDS (1u << 20)
+#define ID_PAGE_BITS 16
+
+struct mem_T {
+        seg_T *mapped_ids;
+        uint32_t mapped_length;
+
+        /* segments mapped now, and the first identifier never handed out */
+        uint32_t mapped_used;
+        uint64_t next_id;
+
+        /* slots for identifiers MAX_FLAT_IDS and up */
+        seg_T **id_pages;
+        uint32_t num_id_pages;
+
+        /* stack of identifiers waiting to be reused */
+        uint32_t *unmapped_ids;
+        uint32_t unmapped_used;
+        uint32_t unmapped_length;
+
+        /* recycled blocks, one list per size class */
+        seg_T free_blocks[NUM_SIZE_CLASSES];
+
+        /* segments this long or longer are mapped on their own */
+        uint32_t mmap_words;
+        seg_T retained[MAX_RETAINED_MAPPINGS];
+        uint32_t num_retained;
+
+        /* a restored snapshot's mapping; segments in it are never freed */
+        char *borrowed;
+        size_t borrowed_length;
+
+        /*
+         * Usage counters, always kept, for mem_report. Live and peak
+         * figures count segments actually held, so a segment shared
+         * by m[0] and another identifier counts once. The histograms
+         * are by size class, with larger segments in the last bucket.
+         */
+        uint64_t live_segments;
+        uint64_t live_words;
+        uint64_t peak_segments;
+        uint64_t peak_words;
+        uint64_t maps;
+        uint64_t unmaps;
+        uint64_t class_maps[NUM_SIZE_CLASSES + 1];
+        uint64_t class_live[NUM_SIZE_CLASSES + 1];
+};
+
+/* Purpose: finds the table slot holding a mapped identifier's segment
+* Input:    mem_segments -- our memory struct
+*           id -- an identifier below the high-water mark
+* Output:   a pointer to the slot
+*/
+static inline seg_T *segment_slot(mem_T mem_segments, uint32_t id)
+{
+        if (id < mem_segments->mapped_length) {
+                return &mem_segments->mapped_ids[id];
+        }
+
+        id -= MAX_FLAT_IDS;
+
+        return &mem_segments->id_pages[id >> ID_PAGE_BITS]
+                                      [id & ((1u << ID_PAGE_BITS) - 1)];
+}
+
+/* Purpose: finds the segment mapped at an identifier
+* Input:    mem_segments -- our memory struct
+*           id -- a mapped identifier
+* Output:   the segment
+*/
+static inline seg_T segment_at(mem_T mem_segments, uint32_t id)
+{
+        return *segment_slot(mem_segments, id);
+}
+
 /* Creates a memory instance. */
 mem_T mem_new();
 /* Frees a memory instance. */
@@ -33,17 +148,34 @@ uint32_t map_segment(mem_T mem_segments, uint32_t num_words);
 /* Unmaps a memory segment. */
 void unmap_segment(mem_T mem_segments, uint32_t identifier);
 /* Creates the program m[0] and stores it in memory. */
-void initalize_program(mem_T mem_segments, Seq_T instructions);
+void initalize_program(mem_T mem_segments, const uint32_t *instructions,
+                       uint32_t num_words);
 /* Retrieves a word from memory. */
 uint32_t segmented_load(mem_T mem_segments, uint32_t id, uint32_t index);
 /* Stores a word from memory. */
-void segmented_store(mem_T mem_segments, uint32_t id, uint32_t index, 
+void segmented_store(mem_T mem_segments, uint32_t id, uint32_t index,
                      uint32_t word);
+/* Gives an identifier its own copy of a shared segment. */
+seg_T unshare_segment(mem_T mem_segments, uint32_t id);
 /* Creates the program m[0] using a segment stored in memory. */
-void load_program(mem_T mem_segments, uint32_t id);
+bool load_program(mem_T mem_segments, uint32_t id);
 /* Gets the length of a segment in memory. */
 uint32_t segment_length(mem_T mem_segments, uint32_t id);
 /* Gets a word from a segment in memory. */
 uint32_t segment_word(mem_T mem_segments, uint32_t id, int index);
+/* Sets the length from which segments get mappings of their own; only
+ * before anything is mapped. */
+void mem_mmap_threshold(mem_T mem_segments, uint32_t num_words);
+/* Maps a segment read back from a snapshot at the given identifier. */
+void restore_segment(mem_T mem_segments, uint32_t id, seg_T segment);
+/* Sets the identifiers handed out so far and the unmapped ones, oldest
+ * first, once a snapshot's segments are restored. */
+void restore_ids(mem_T mem_segments, uint64_t next_id,
+                 const uint32_t *unmapped, uint32_t num_unmapped);
+/* Gives memory the mapping restored segments live in, to unmap at the end. */
+void mem_borrow(mem_T mem_segments, void *start, size_t length);
+/* Writes the usage counters to a file descriptor with write(2) alone, so
+ * it is safe to call from a signal handler. */
+void mem_report(mem_T mem_segments, int fd, uint64_t elapsed_ms);
 
 #endif
@@ -0,0 +1,362 @@
+/********************************************************************
+ *
+ *                     profile.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *     
+ *     Implementation for the profile module. Time is measured in
+ *     timestamp-counter cycles between one dispatch and the next, and
+ *     charged to the opcode that was running.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define HOT_PCS 25
+#define HOT_SEQUENCES 12
+
+struct profile_T {
+        uint64_t op_counts[NUM_OPCODES];
+        uint64_t op_cycles[NUM_OPCODES];
+        uint64_t *pc_counts;
+        uint32_t pc_length;
+
+        /* the instruction being timed, and when it was dispatched */
+        int current_op;
+        uint64_t current_start;
+
+        /*
+         * Runs of two and three opcodes at consecutive PCs, the
+         * candidates for fused handlers. The last two instructions are
+         * remembered with the PC after them, so a jump starts a new run.
+         */
+        uint64_t pair_counts[NUM_OPCODES][NUM_OPCODES];
+        uint64_t triple_counts[NUM_OPCODES][NUM_OPCODES][NUM_OPCODES];
+        unsigned last_ops[2];
+        unsigned run_length;
+        uint32_t next_pc;
+};
+
+/* a PC and how often it ran, for sorting */
+struct pc_count {
+        uint64_t count;
+        uint32_t pc;
+};
+
+static const char *op_names[NUM_OPCODES] = {
+        "cmov", "sload", "sstore", "add", "mul", "div", "nand", "halt",
+        "map", "unmap", "out", "in", "loadp", "loadv", "invalid", "invalid"
+};
+
+/* Opcodes are grouped into classes for the time summary. */
+#define NUM_CLASSES 5
+
+static const char *class_names[NUM_CLASSES] = {
+        "register", "memory", "allocation", "i/o", "control"
+};
+
+static const int op_class[NUM_OPCODES] = {
+        0, 1, 1, 0, 0, 0, 0, 4, 2, 2, 3, 3, 4, 0, 4, 4
+};
+
+/* Purpose: reads a cycle counter
+* Input:    none
+* Output:   the current cycle count, or nanoseconds where there is no
+*           timestamp counter
+*/
+static inline uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* Purpose: charges the cycles since the last dispatch to the
+*           instruction that was running
+* Input:    profile -- the profile
+*           now -- the current cycle count
+* Output:   none
+*/
+static inline void charge_current(profile_T profile, uint64_t now)
+{
+        if (profile->current_op >= 0) {
+                profile->op_cycles[profile->current_op] +=
+                                        now - profile->current_start;
+        }
+
+        profile->current_start = now;
+}
+
+/* Purpose: starts counting
+* Input:    program_length -- the length of m[0]
+* Output:   a new profile, with every count 0
+*/
+profile_T profile_new(uint32_t program_length)
+{
+        profile_T profile = calloc(1, sizeof(*profile));
+        assert(profile != NULL);
+
+        profile->current_op = -1;
+        profile_program(profile, program_length);
+
+        return profile;
+}
+
+/* Purpose: frees a profile
+* Input:    profile -- the profile
+* Output:   none
+*/
+void profile_free(profile_T profile)
+{
+        free(profile->pc_counts);
+        free(profile);
+}
+
+/* Purpose: grows the per-PC counters to cover a new m[0]
+* Input:    profile -- the profile
+*           program_length -- the length of the new m[0]
+* Output:   none
+*/
+void profile_program(profile_T profile, uint32_t program_length)
+{
+        uint32_t old_length = profile->pc_length;
+
+        if (program_length <= old_length) {
+                return;
+        }
+
+        profile->pc_counts = realloc(profile->pc_counts, 
+                        program_length * sizeof(*profile->pc_counts));
+        assert(profile->pc_counts != NULL);
+
+        memset(profile->pc_counts + old_length, 0, 
+               (program_length - old_length) * sizeof(*profile->pc_counts));
+        profile->pc_length = program_length;
+}
+
+/* Purpose: records one executed instruction, and charges the cycles
+*           since the previous one to the previous one's opcode
+* Input:    profile -- the profile
+*           pc -- where the instruction is in m[0]
+*           op_code -- its opcode
+* Output:   none
+*/
+void profile_count(profile_T profile, uint32_t pc, unsigned op_code)
+{
+        unsigned *last_ops = profile->last_ops;
+
+        charge_current(profile, cycles());
+        profile->current_op = op_code;
+
+        profile->op_counts[op_code]++;
+        if (pc < profile->pc_length) {
+                profile->pc_counts[pc]++;
+        }
+
+        if (pc != profile->next_pc) {
+                profile->run_length = 0;
+        }
+        if (profile->run_length >= 1) {
+                profile->pair_counts[last_ops[1]][op_code]++;
+        }
+        if (profile->run_length >= 2) {
+                profile->triple_counts[last_ops[0]][last_ops[1]][op_code]++;
+        }
+
+        last_ops[0] = last_ops[1];
+        last_ops[1] = op_code;
+        profile->run_length++;
+        profile->next_pc = pc + 1;
+}
+
+/* Purpose: orders PCs by execution count, most frequent first
+* Input:    two pointers to struct pc_counts
+* Output:   qsort's comparison result
+*/
+static int compare_pcs(const void *a, const void *b)
+{
+        uint64_t count_a = ((const struct pc_count *)a)->count;
+        uint64_t count_b = ((const struct pc_count *)b)->count;
+
+        return (count_a < count_b) - (count_a > count_b);
+}
+
+/* Purpose: prints the most frequent runs of two or three opcodes
+* Input:    profile -- the profile
+*           out -- where to write
+*           length -- 2 for pairs, 3 for triples
+*           inst_share -- percent per instruction executed
+* Output:   none
+*/
+static void print_sequences(profile_T profile, FILE *out, int length,
+                            double inst_share)
+{
+        int num_sequences = 1 << (4 * length);
+        uint32_t order[NUM_OPCODES * NUM_OPCODES * NUM_OPCODES];
+        uint64_t *counts = (length == 2) ? &profile->pair_counts[0][0] 
+                                         : &profile->triple_counts[0][0][0];
+
+        /* Selection sort is fine for a dozen winners. */
+        for (int i = 0; i < num_sequences; i++) {
+                order[i] = i;
+        }
+
+        fprintf(out, "\nhot opcode %s\n", (length == 2) ? "pairs" : "triples");
+        fprintf(out, "%-22s %14s %7s\n", "sequence", "count", "%");
+
+        for (int i = 0; i < HOT_SEQUENCES && i < num_sequences; i++) {
+                for (int j = i + 1; j < num_sequences; j++) {
+                        if (counts[order[j]] > counts[order[i]]) {
+                                uint32_t swap = order[i];
+                                order[i] = order[j];
+                                order[j] = swap;
+                        }
+                }
+
+                uint32_t sequence = order[i];
+                if (counts[sequence] == 0) {
+                        break;
+                }
+
+                char name[32] = "";
+                for (int k = length - 1; k >= 0; k--) {
+                        strcat(name, op_names[(sequence >> (4 * k)) & 0xf]);
+                        if (k > 0) {
+                                strcat(name, " ");
+                        }
+                }
+
+                fprintf(out, "%-22s %14lu %6.2f%%\n", name, 
+                        (unsigned long)counts[sequence],
+                        counts[sequence] * inst_share);
+        }
+}
+
+/* Purpose: writes out an instruction word the way the tables show it
+* Input:    out -- where to write
+*           word -- the instruction
+* Output:   none
+*/
+static void print_instruction(FILE *out, uint32_t word)
+{
+        unsigned op_code = word >> 28;
+
+        if (op_code == 13) {
+                fprintf(out, "%-6s r%u, %u", op_names[op_code], 
+                        (word >> 25) & 0x7, word & 0x1ffffff);
+        } else {
+                fprintf(out, "%-6s r%u, r%u, r%u", op_names[op_code],
+                        (word >> 6) & 0x7, (word >> 3) & 0x7, word & 0x7);
+        }
+}
+
+/* Purpose: prints the profile
+* Input:    profile -- the profile
+*           out -- where to write it
+*           m0 -- the program in m[0] at halt
+*           m0_length -- its length
+* Output:   none
+*/
+void profile_report(profile_T profile, FILE *out, const uint32_t *m0,
+                    uint32_t m0_length)
+{
+        const uint64_t *op_counts = profile->op_counts;
+        const uint64_t *op_cycles = profile->op_cycles;
+        const uint64_t *pc_counts = profile->pc_counts;
+        uint32_t pc_length = profile->pc_length;
+
+        charge_current(profile, cycles());
+        profile->current_op = -1;
+
+        uint64_t total = 0, total_cycles = 0;
+        uint64_t class_counts[NUM_CLASSES] = { 0 };
+        uint64_t class_cycles[NUM_CLASSES] = { 0 };
+
+        for (int op = 0; op < NUM_OPCODES; op++) {
+                total += op_counts[op];
+                total_cycles += op_cycles[op];
+                class_counts[op_class[op]] += op_counts[op];
+                class_cycles[op_class[op]] += op_cycles[op];
+        }
+
+        double inst_share = total ? 100.0 / total : 0;
+        double cycle_share = total_cycles ? 100.0 / total_cycles : 0;
+
+        fprintf(out, "== UM profile: %lu instructions, %lu cycles ==\n",
+                (unsigned long)total, (unsigned long)total_cycles);
+
+        fprintf(out, "\n%-10s %14s %7s %16s %7s %10s\n", "opcode", "count",
+                "%", "cycles", "%", "cyc/inst");
+        for (int op = 0; op < 14; op++) {
+                fprintf(out, "%-10s %14lu %6.2f%% %16lu %6.2f%% %10.1f\n",
+                        op_names[op], (unsigned long)op_counts[op],
+                        op_counts[op] * inst_share,
+                        (unsigned long)op_cycles[op],
+                        op_cycles[op] * cycle_share,
+                        op_counts[op] ? (double)op_cycles[op] / 
+                                        op_counts[op] : 0.0);
+        }
+
+        fprintf(out, "\n%-10s %14s %7s %16s %7s\n", "class", "count", "%",
+                "cycles", "%");
+        for (int c = 0; c < NUM_CLASSES; c++) {
+                fprintf(out, "%-10s %14lu %6.2f%% %16lu %6.2f%%\n",
+                        class_names[c], (unsigned long)class_counts[c],
+                        class_counts[c] * inst_share,
+                        (unsigned long)class_cycles[c],
+                        class_cycles[c] * cycle_share);
+        }
+
+        print_sequences(profile, out, 2, inst_share);
+        print_sequences(profile, out, 3, inst_share);
+
+        /* Sort the PCs that ran at all by count. */
+        struct pc_count *pcs = malloc((pc_length + 1) * sizeof(*pcs));
+        assert(pcs != NULL);
+
+        uint32_t num_pcs = 0;
+        for (uint32_t pc = 0; pc < pc_length; pc++) {
+                if (pc_counts[pc] != 0) {
+                        pcs[num_pcs].count = pc_counts[pc];
+                        pcs[num_pcs].pc = pc;
+                        num_pcs++;
+                }
+        }
+        qsort(pcs, num_pcs, sizeof(*pcs), compare_pcs);
+
+        fprintf(out, "\nhot PCs (%u of %u executed)\n", num_pcs, pc_length);
+        fprintf(out, "%10s %14s %7s  %s\n", "pc", "count", "%",
+                "instruction in final m[0]");
+        for (uint32_t i = 0; i < num_pcs && i < HOT_PCS; i++) {
+                uint32_t pc = pcs[i].pc;
+
+                fprintf(out, "%10u %14lu %6.2f%%  ", pc,
+                        (unsigned long)pc_counts[pc],
+                        pc_counts[pc] * inst_share);
+                if (pc < m0_length) {
+                        print_instruction(out, m0[pc]);
+                }
+                fputc('\n', out);
+        }
+
+        free(pcs);
+}
+
+#undef HOT_PCS
+#undef HOT_SEQUENCES
+#undef NUM_CLASSES
@@ -0,0 +1,48 @@
+/********************************************************************
+ *
+ *                     profile.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *     
+ *     Interface for the profile module. Counts how often each
+ *     opcode, each m[0] program counter and each run of two or
+ *     three opcodes executes, and how many cycles each opcode
+ *     takes, for "um --profile". Each machine has its own profile,
+ *     so machines running at once don't share counters. The run loop
+ *     only calls in here when um is built with "make PROFILE=1".
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef PROFILE
+#define PROFILE
+
+#define NUM_OPCODES 16
+
+typedef struct profile_T *profile_T;
+
+/* Starts counting, for a program of the given length. */
+profile_T profile_new(uint32_t program_length);
+
+/* Frees a profile. */
+void profile_free(profile_T profile);
+
+/* Makes room for counters when a longer program is loaded. */
+void profile_program(profile_T profile, uint32_t program_length);
+
+/* Records that the instruction at pc, with opcode op_code, ran. */
+void profile_count(profile_T profile, uint32_t pc, unsigned op_code);
+
+/* Prints the opcode, opcode class, opcode sequence and hot-PC tables;
+ * m0 is used to show the instruction at each hot PC. */
+void profile_report(profile_T profile, FILE *out, const uint32_t *m0,
+                    uint32_t m0_length);
+
+#endif
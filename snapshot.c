@@ -0,0 +1,348 @@
+/********************************************************************
+ *
+ *                     snapshot.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Implementation for the snapshot module. A snapshot file is
+ *
+ *       header      magic, registers, program counter, counts and
+ *                   the offsets of the parts below
+ *       id table    one 64-bit file offset per identifier below the
+ *                   high-water mark, 0 for an unmapped identifier
+ *       unmapped    the stack of unmapped identifiers, bottom first
+ *       payload     starting on a page boundary: every segment as a
+ *                   struct seg_T header followed by its words
+ *
+ *     Segments of a page or more start on a page boundary; smaller
+ *     ones are packed 16 bytes apart. A segment shared by m[0] and
+ *     another identifier is written once and both table entries
+ *     point at it. Words are in host byte order, so a snapshot only
+ *     restores on the kind of machine that wrote it.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+#define MAGIC "UMSNAP01"
+#define MAGIC_LEN 8
+#define NUM_REGISTERS 8
+#define PAGE_BYTES 4096
+#define SEGMENT_ALIGN 16
+
+struct header {
+        char magic[MAGIC_LEN];
+        uint32_t registers[NUM_REGISTERS];
+        uint32_t program_counter;
+        uint32_t num_unmapped;
+        uint64_t next_id;
+        uint64_t ids_offset;
+        uint64_t unmapped_offset;
+        uint64_t payload_offset;
+        uint64_t file_length;
+};
+
+/* Purpose: rounds an offset up to a multiple of a power of two
+* Input:    offset -- the offset
+*           alignment -- the power of two
+* Output:   the rounded offset
+*/
+static inline uint64_t align_up(uint64_t offset, uint64_t alignment)
+{
+        return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/* Purpose: finds the size of a segment as stored, header included
+* Input:    segment -- the segment
+* Output:   its size in bytes
+*/
+static inline uint64_t stored_bytes(seg_T segment)
+{
+        return sizeof(struct seg_T) +
+               (uint64_t)segment->seg_length * sizeof(uint32_t);
+}
+
+/* Purpose: finds where a segment goes in the payload
+* Input:    end -- the end of the payload so far
+*           bytes -- the segment's stored size
+* Output:   its offset in the file
+*/
+static inline uint64_t place_segment(uint64_t end, uint64_t bytes)
+{
+        return align_up(end, (bytes >= PAGE_BYTES) ? PAGE_BYTES
+                                                   : SEGMENT_ALIGN);
+}
+
+/* Purpose: writes zero bytes
+* Input:    file -- where to write
+*           count -- how many, fewer than a page
+* Output:   none
+*/
+static void write_padding(FILE *file, uint64_t count)
+{
+        static const char zeros[PAGE_BYTES];
+
+        assert(count < PAGE_BYTES);
+        fwrite(zeros, 1, count, file);
+}
+
+/* Purpose: writes the machine's state to a snapshot file
+* Input:    path -- the file to write
+*           memory -- the UM's memory
+*           registers -- its registers
+*           program_counter -- where it resumes
+* Output:   true on success; errors are reported on stderr
+*/
+bool snapshot_save(const char *path, mem_T memory, const uint32_t *registers,
+                   uint32_t program_counter)
+{
+        struct header header;
+        uint64_t next_id = memory->next_id;
+        seg_T m0 = memory->mapped_ids[0];
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MAGIC, MAGIC_LEN);
+        memcpy(header.registers, registers, sizeof(header.registers));
+        header.program_counter = program_counter;
+        header.num_unmapped = memory->unmapped_used;
+        header.next_id = next_id;
+        header.ids_offset = align_up(sizeof(header), sizeof(uint64_t));
+        header.unmapped_offset = header.ids_offset +
+                                 next_id * sizeof(uint64_t);
+        header.payload_offset = align_up(header.unmapped_offset +
+                        header.num_unmapped * sizeof(uint32_t), PAGE_BYTES);
+
+        /* Lay out the payload first so the id table can go before it. */
+        uint64_t *offsets = calloc(next_id + 1, sizeof(*offsets));
+        assert(offsets != NULL);
+
+        uint64_t end = header.payload_offset;
+
+        for (uint64_t id = 0; id < next_id; id++) {
+                seg_T segment = segment_at(memory, id);
+
+                if (segment == NULL) {
+                        continue;
+                }
+                if (id != 0 && segment == m0) {
+                        offsets[id] = offsets[0];
+                        continue;
+                }
+
+                offsets[id] = place_segment(end, stored_bytes(segment));
+                end = offsets[id] + stored_bytes(segment);
+        }
+
+        header.file_length = align_up(end, PAGE_BYTES);
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+                perror(path);
+                free(offsets);
+                return false;
+        }
+
+        fwrite(&header, sizeof(header), 1, file);
+        write_padding(file, header.ids_offset - sizeof(header));
+        fwrite(offsets, sizeof(*offsets), next_id, file);
+        fwrite(memory->unmapped_ids, sizeof(uint32_t), header.num_unmapped,
+               file);
+
+        end = header.unmapped_offset + header.num_unmapped * sizeof(uint32_t);
+
+        for (uint64_t id = 0; id < next_id; id++) {
+                seg_T segment = segment_at(memory, id);
+
+                if (segment == NULL || (id != 0 && segment == m0)) {
+                        continue;
+                }
+
+                struct seg_T stored = {
+                        .next_free = NULL,
+                        .seg_length = segment->seg_length,
+                        .refs = segment->refs
+                };
+
+                write_padding(file, offsets[id] - end);
+                fwrite(&stored, sizeof(stored), 1, file);
+                fwrite(segment->segments, sizeof(uint32_t),
+                       segment->seg_length, file);
+                end = offsets[id] + stored_bytes(segment);
+        }
+
+        write_padding(file, header.file_length - end);
+        free(offsets);
+
+        if (ferror(file) | fclose(file)) {
+                perror(path);
+                return false;
+        }
+
+        return true;
+}
+
+/* Purpose: orders identifiers, for qsort
+* Input:    a, b -- the identifiers
+* Output:   qsort's comparison result
+*/
+static int compare_ids(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t *)a;
+        uint32_t y = *(const uint32_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+/* Purpose: checks a snapshot's unmapped identifiers before Map Segment
+*           hands them out again: each has to be one that was handed out
+*           before, other than 0, with no segment in its slot, and be
+*           listed once
+* Input:    offsets -- the snapshot's segment offsets, 0 for an empty slot
+*           next_id -- the first identifier never handed out
+*           unmapped -- the unmapped identifiers
+*           num_unmapped -- how many there are
+* Output:   true if they can be handed out safely
+*/
+static bool valid_unmapped(const uint64_t *offsets, uint64_t next_id,
+                           const uint32_t *unmapped, uint32_t num_unmapped)
+{
+        uint32_t *sorted = malloc(((size_t)num_unmapped + 1) *
+                                  sizeof(*sorted));
+        assert(sorted != NULL);
+
+        memcpy(sorted, unmapped, (size_t)num_unmapped * sizeof(*sorted));
+        qsort(sorted, num_unmapped, sizeof(*sorted), compare_ids);
+
+        bool valid = true;
+
+        for (uint32_t i = 0; i < num_unmapped && valid; i++) {
+                uint32_t id = sorted[i];
+
+                valid = id != 0 && id < next_id && offsets[id] == 0 &&
+                        (i == 0 || id != sorted[i - 1]);
+        }
+
+        free(sorted);
+
+        return valid;
+}
+
+/* Purpose: restores a machine's state from a snapshot file, leaving the
+*           segments in a private mapping of the file
+* Input:    path -- the file to read
+*           memory -- a memory fresh from mem_new()
+*           registers -- filled in with the saved registers
+*           program_counter -- filled in with the saved program counter
+* Output:   true on success; errors are reported on stderr
+*/
+bool snapshot_restore(const char *path, mem_T memory, uint32_t *registers,
+                      uint32_t *program_counter)
+{
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                perror(path);
+                return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+                perror(path);
+                close(fd);
+                return false;
+        }
+
+        uint64_t size = info.st_size;
+        if (size < sizeof(struct header)) {
+                fprintf(stderr, "%s: not a UM snapshot\n", path);
+                close(fd);
+                return false;
+        }
+
+        /* Stores into restored segments stay private to this process. */
+        char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+                perror(path);
+                return false;
+        }
+
+        mem_borrow(memory, base, size);
+
+        struct header header;
+        memcpy(&header, base, sizeof(header));
+
+        if (memcmp(header.magic, MAGIC, MAGIC_LEN) != 0 ||
+            header.file_length != size ||
+            header.next_id == 0 || header.next_id > (uint64_t)UINT32_MAX + 1 ||
+            header.ids_offset % sizeof(uint64_t) != 0 ||
+            header.unmapped_offset != header.ids_offset +
+                                      header.next_id * sizeof(uint64_t) ||
+            header.unmapped_offset + header.num_unmapped *
+                                     sizeof(uint32_t) > size) {
+                fprintf(stderr, "%s: not a UM snapshot\n", path);
+                return false;
+        }
+
+        const uint64_t *offsets = (const uint64_t *)(base + header.ids_offset);
+
+        for (uint64_t id = 0; id < header.next_id; id++) {
+                uint64_t offset = offsets[id];
+
+                if (offset == 0) {
+                        continue;
+                }
+
+                seg_T segment = (seg_T)(base + offset);
+
+                if (offset % SEGMENT_ALIGN != 0 ||
+                    offset < header.payload_offset ||
+                    offset + sizeof(struct seg_T) > size ||
+                    offset + stored_bytes(segment) > size) {
+                        fprintf(stderr, "%s: segment %lu is corrupt\n",
+                                path, (unsigned long)id);
+                        return false;
+                }
+
+                restore_segment(memory, id, segment);
+        }
+
+        if (memory->mapped_ids[0] == NULL) {
+                fprintf(stderr, "%s: no program in m[0]\n", path);
+                return false;
+        }
+
+        const uint32_t *unmapped = (const uint32_t *)(base +
+                                                      header.unmapped_offset);
+
+        /* A bad one would be handed out while its segment is mapped. */
+        if (!valid_unmapped(offsets, header.next_id, unmapped,
+                            header.num_unmapped)) {
+                fprintf(stderr, "%s: unmapped identifiers are corrupt\n",
+                        path);
+                return false;
+        }
+
+        restore_ids(memory, header.next_id, unmapped, header.num_unmapped);
+
+        memcpy(registers, header.registers, sizeof(header.registers));
+        *program_counter = header.program_counter;
+
+        return true;
+}
+
+#undef MAGIC
+#undef MAGIC_LEN
+#undef NUM_REGISTERS
+#undef PAGE_BYTES
+#undef SEGMENT_ALIGN
@@ -0,0 +1,38 @@
+/********************************************************************
+ *
+ *                     snapshot.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Interface for the snapshot module. Saves a running machine's
+ *     registers, program counter, segments and unmapped identifiers
+ *     to a file for "um --snapshot-at-input", and restores them for
+ *     "um --restore". Segments are laid out in the file exactly as
+ *     memory_segment keeps them, so restoring maps the file and
+ *     points the segment table into it; pages are read in only
+ *     when the program touches them.
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory_segment.h"
+
+#ifndef SNAPSHOT
+#define SNAPSHOT
+
+/* Writes the machine's state to path; reports errors on stderr. */
+bool snapshot_save(const char *path, mem_T memory, const uint32_t *registers,
+                   uint32_t program_counter);
+
+/* Restores state from path into memory, which must be fresh from
+ * mem_new(); reports errors on stderr. */
+bool snapshot_restore(const char *path, mem_T memory, uint32_t *registers,
+                      uint32_t *program_counter);
+
+#endif
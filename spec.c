@@ -0,0 +1,92 @@
+/********************************************************************
+ *
+ *                     spec.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Implementation for the spec module. Decodes every word as it
+ *     runs and does exactly what the spec says, with no predecoding,
+ *     fusion or caching, so that it is slow and easy to believe.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "spec.h"
+
+/* Purpose: runs one instruction
+* Input:    memory -- the machine's memory
+*           registers -- its registers
+*           pc -- its program counter, moved on
+*           input -- what an Input reads
+*           output -- set to what an Output writes, or -1
+* Output:   false if the machine stops
+*/
+bool spec_step(mem_T memory, uint32_t *registers, uint32_t *pc,
+               uint32_t input, int *output)
+{
+        uint32_t *r = registers;
+        uint32_t word = segment_word(memory, 0, *pc);
+        unsigned a = (word >> 6) & 0x7;
+        unsigned b = (word >> 3) & 0x7;
+        unsigned c = word & 0x7;
+
+        *output = -1;
+        (*pc)++;
+
+        switch (word >> 28) {
+        case 0:
+                if (r[c] != 0) {
+                        r[a] = r[b];
+                }
+                return true;
+        case 1:
+                r[a] = segmented_load(memory, r[b], r[c]);
+                return true;
+        case 2:
+                segmented_store(memory, r[a], r[b], r[c]);
+                return true;
+        case 3:
+                r[a] = r[b] + r[c];
+                return true;
+        case 4:
+                r[a] = r[b] * r[c];
+                return true;
+        case 5:
+                if (r[c] == 0) {
+                        return false;
+                }
+                r[a] = r[b] / r[c];
+                return true;
+        case 6:
+                r[a] = ~(r[b] & r[c]);
+                return true;
+        case 8:
+                r[b] = map_segment(memory, r[c]);
+                return true;
+        case 9:
+                unmap_segment(memory, r[c]);
+                return true;
+        case 10:
+                *output = r[c];
+                return true;
+        case 11:
+                r[c] = input;
+                return true;
+        case 12:
+                if (r[b] != 0) {
+                        load_program(memory, r[b]);
+                }
+                *pc = r[c];
+                return true;
+        case 13:
+                r[(word >> 25) & 0x7] = word & 0x1FFFFFF;
+                return true;
+        default:
+                /* halt and invalid opcodes */
+                return false;
+        }
+}
@@ -0,0 +1,33 @@
+/********************************************************************
+ *
+ *                     spec.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Interface for the spec module: the plainest reading of the UM
+ *     spec, one instruction at a time, sharing nothing with the run
+ *     loops in um.c but the memory module. um_replay and um_fuzz
+ *     check the machine against it.
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory_segment.h"
+
+#ifndef SPEC
+#define SPEC
+
+/* Runs the instruction at *pc of m[0] and moves *pc on. An Input reads
+ * input; *output is set to the byte an Output writes, and to -1 for any
+ * other instruction. Returns false if the machine stops: it halted, or
+ * hit an invalid opcode or a division by zero, which the spec leaves
+ * undefined. */
+bool spec_step(mem_T memory, uint32_t *registers, uint32_t *pc,
+               uint32_t input, int *output);
+
+#endif
@@ -0,0 +1,451 @@
+/********************************************************************
+ *
+ *                     trace.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Implementation for the trace module. A trace is the bytes
+ *     "UMTRACE1" followed by one record per instruction:
+ *
+ *         a byte: opcode << 4 | jumped << 3 | wrote << 2
+ *         if jumped, the pc, less the one after the last record's
+ *         if wrote, the new value, less the register's old value,
+ *             shifted left 3 and or'd with the register
+ *
+ *     Differences are zigzag-encoded, so that small negative ones are
+ *     small too, and written as varints of 7 bits a byte, low bits
+ *     first. Most records are one or two bytes.
+ *
+ *     The run loop only encodes: it fills a chunk of a ring of chunks
+ *     and hands each full one to a thread that writes it to the file,
+ *     waiting only when every chunk is still waiting to be written.
+ *     What an instruction changed is found by comparing the registers
+ *     with the last record's when the next instruction is traced.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include "trace.h"
+
+#define MAGIC "UMTRACE1"
+#define MAGIC_LEN 8
+#define CHUNK_SIZE (1 << 20)
+#define NUM_CHUNKS 8
+#define NUM_REGISTERS 8
+
+/* longest record: the byte and two varints of up to 35 bits */
+#define MAX_RECORD 11
+
+#define JUMPED 0x08
+#define WROTE 0x04
+
+struct trace_T {
+        FILE *file;
+        const char *path;
+
+        /* chunks handed over and chunks written, counted from the start;
+         * chunk n is chunks[n % NUM_CHUNKS] */
+        pthread_mutex_t lock;
+        pthread_cond_t changed;
+        pthread_t writer;
+        uint64_t handed;
+        uint64_t written;
+        bool closing;
+        bool failed;
+        unsigned char *chunks[NUM_CHUNKS];
+        size_t lengths[NUM_CHUNKS];
+
+        /* the run loop's side: the chunk being filled, and the last
+         * record's pc and registers */
+        unsigned char *chunk;
+        size_t used;
+        uint32_t last_pc;
+        uint32_t registers[NUM_REGISTERS];
+
+        /* the instruction traced but not yet recorded */
+        bool pending;
+        uint32_t pc;
+        unsigned op_code;
+};
+
+struct trace_reader_T {
+        FILE *file;
+        uint32_t last_pc;
+        uint32_t registers[NUM_REGISTERS];
+};
+
+/* Purpose: zigzag-encodes a difference
+* Input:    difference -- the difference, mod 2^32
+* Output:   0, -1, 1, -2, ... as 0, 1, 2, 3, ...
+*/
+static inline uint32_t zigzag(uint32_t difference)
+{
+        return (difference << 1) ^ (0 - (difference >> 31));
+}
+
+/* Purpose: undoes zigzag()
+* Input:    encoded -- the encoded difference
+* Output:   the difference, mod 2^32
+*/
+static inline uint32_t unzigzag(uint32_t encoded)
+{
+        return (encoded >> 1) ^ (0 - (encoded & 1));
+}
+
+/* Purpose: writes out chunks as the run loop hands them over, until the
+*           trace is closed and every chunk is written
+* Input:    cl -- the trace
+* Output:   NULL
+*/
+static void *write_chunks(void *cl)
+{
+        trace_T trace = cl;
+
+        pthread_mutex_lock(&trace->lock);
+
+        while (true) {
+                while (trace->written == trace->handed && !trace->closing) {
+                        pthread_cond_wait(&trace->changed, &trace->lock);
+                }
+                if (trace->written == trace->handed) {
+                        break;
+                }
+
+                unsigned i = trace->written % NUM_CHUNKS;
+                bool failed = trace->failed;
+
+                /* The run loop doesn't touch a handed-over chunk. */
+                pthread_mutex_unlock(&trace->lock);
+                if (!failed) {
+                        failed = fwrite(trace->chunks[i], 1,
+                                        trace->lengths[i], trace->file) !=
+                                 trace->lengths[i];
+                }
+                pthread_mutex_lock(&trace->lock);
+
+                trace->failed = failed;
+                trace->written++;
+                pthread_cond_broadcast(&trace->changed);
+        }
+
+        pthread_mutex_unlock(&trace->lock);
+        return NULL;
+}
+
+/* Purpose: hands the chunk being filled to the writer, and waits for a
+*           chunk to fill next
+* Input:    trace -- the trace
+* Output:   none
+*/
+static void hand_over(trace_T trace)
+{
+        pthread_mutex_lock(&trace->lock);
+
+        trace->lengths[trace->handed % NUM_CHUNKS] = trace->used;
+        trace->handed++;
+        pthread_cond_broadcast(&trace->changed);
+
+        while (trace->handed - trace->written == NUM_CHUNKS) {
+                pthread_cond_wait(&trace->changed, &trace->lock);
+        }
+
+        pthread_mutex_unlock(&trace->lock);
+
+        trace->chunk = trace->chunks[trace->handed % NUM_CHUNKS];
+        trace->used = 0;
+}
+
+/* Purpose: appends a varint to the chunk being filled
+* Input:    trace -- the trace
+*           value -- the value
+* Output:   none
+*/
+static inline void put_varint(trace_T trace, uint64_t value)
+{
+        while (value >= 0x80) {
+                trace->chunk[trace->used++] = (value & 0x7F) | 0x80;
+                value >>= 7;
+        }
+        trace->chunk[trace->used++] = value;
+}
+
+/* Purpose: records the pending instruction
+* Input:    trace -- the trace, with an instruction pending
+*           registers -- the registers after it ran
+* Output:   none
+*/
+static void record(trace_T trace, const uint32_t *registers)
+{
+        if (CHUNK_SIZE - trace->used < MAX_RECORD) {
+                hand_over(trace);
+        }
+
+        unsigned header = trace->op_code << 4;
+        unsigned reg = NUM_REGISTERS;
+
+        for (unsigned i = 0; i < NUM_REGISTERS; i++) {
+                if (registers[i] != trace->registers[i]) {
+                        /* No instruction writes more than one. */
+                        assert(reg == NUM_REGISTERS);
+                        reg = i;
+                }
+        }
+
+        if (trace->pc != trace->last_pc + 1) {
+                header |= JUMPED;
+        }
+        if (reg != NUM_REGISTERS) {
+                header |= WROTE;
+        }
+
+        trace->chunk[trace->used++] = header;
+
+        if (header & JUMPED) {
+                put_varint(trace, zigzag(trace->pc - (trace->last_pc + 1)));
+        }
+        if (header & WROTE) {
+                uint32_t value = registers[reg];
+
+                put_varint(trace, (uint64_t)zigzag(value -
+                                                   trace->registers[reg]) << 3
+                                  | reg);
+                trace->registers[reg] = value;
+        }
+
+        trace->last_pc = trace->pc;
+        trace->pending = false;
+}
+
+/* Purpose: starts a trace
+* Input:    path -- the file to write it to
+* Output:   the trace, or NULL with the error reported on stderr
+*/
+trace_T trace_open(const char *path)
+{
+        FILE *file = fopen(path, "wb");
+        if (file == NULL || fwrite(MAGIC, 1, MAGIC_LEN, file) != MAGIC_LEN) {
+                perror(path);
+                if (file != NULL) {
+                        fclose(file);
+                }
+                return NULL;
+        }
+
+        trace_T trace = calloc(1, sizeof(*trace));
+        assert(trace != NULL);
+
+        trace->file = file;
+        trace->path = path;
+        trace->last_pc = UINT32_MAX;
+
+        for (unsigned i = 0; i < NUM_CHUNKS; i++) {
+                trace->chunks[i] = malloc(CHUNK_SIZE);
+                assert(trace->chunks[i] != NULL);
+        }
+        trace->chunk = trace->chunks[0];
+
+        pthread_mutex_init(&trace->lock, NULL);
+        pthread_cond_init(&trace->changed, NULL);
+
+        int error = pthread_create(&trace->writer, NULL, write_chunks, trace);
+        assert(error == 0);
+
+        return trace;
+}
+
+/* Purpose: traces an instruction about to run
+* Input:    trace -- the trace
+*           pc, op_code -- the instruction
+*           registers -- the registers now
+* Output:   none
+*/
+void trace_step(trace_T trace, uint32_t pc, unsigned op_code,
+                const uint32_t *registers)
+{
+        if (trace->pending) {
+                record(trace, registers);
+        }
+
+        trace->pending = true;
+        trace->pc = pc;
+        trace->op_code = op_code;
+}
+
+/* Purpose: records the last instruction traced as the run loop stops
+* Input:    trace -- the trace
+*           registers -- the registers now
+*           ran -- whether that instruction ran
+* Output:   none
+*/
+void trace_pause(trace_T trace, const uint32_t *registers, bool ran)
+{
+        if (trace->pending && ran) {
+                record(trace, registers);
+        }
+        trace->pending = false;
+}
+
+/* Purpose: writes out the rest of a trace and frees it
+* Input:    trace -- the trace
+* Output:   false if any of it couldn't be written
+*/
+bool trace_close(trace_T trace)
+{
+        pthread_mutex_lock(&trace->lock);
+        trace->lengths[trace->handed % NUM_CHUNKS] = trace->used;
+        trace->handed++;
+        trace->closing = true;
+        pthread_cond_broadcast(&trace->changed);
+        pthread_mutex_unlock(&trace->lock);
+
+        pthread_join(trace->writer, NULL);
+
+        bool ok = !trace->failed;
+
+        if (fclose(trace->file) != 0) {
+                ok = false;
+        }
+        if (!ok) {
+                perror(trace->path);
+        }
+
+        pthread_mutex_destroy(&trace->lock);
+        pthread_cond_destroy(&trace->changed);
+        for (unsigned i = 0; i < NUM_CHUNKS; i++) {
+                free(trace->chunks[i]);
+        }
+        free(trace);
+
+        return ok;
+}
+
+/* Purpose: opens a trace for reading
+* Input:    path -- the trace
+* Output:   the reader, or NULL with the error reported on stderr
+*/
+trace_reader_T trace_reader_open(const char *path)
+{
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) {
+                perror(path);
+                return NULL;
+        }
+
+        char magic[MAGIC_LEN];
+
+        if (fread(magic, 1, MAGIC_LEN, file) != MAGIC_LEN ||
+            memcmp(magic, MAGIC, MAGIC_LEN) != 0) {
+                fprintf(stderr, "%s: not a UM trace\n", path);
+                fclose(file);
+                return NULL;
+        }
+
+        trace_reader_T reader = calloc(1, sizeof(*reader));
+        assert(reader != NULL);
+
+        reader->file = file;
+        reader->last_pc = UINT32_MAX;
+
+        return reader;
+}
+
+/* Purpose: reads a varint
+* Input:    file -- where to read it from
+*           value -- set to the value
+* Output:   false if the file ends first or the varint is too long
+*/
+static bool get_varint(FILE *file, uint64_t *value)
+{
+        *value = 0;
+
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+                int byte = getc(file);
+                if (byte == EOF) {
+                        return false;
+                }
+
+                *value |= (uint64_t)(byte & 0x7F) << shift;
+                if ((byte & 0x80) == 0) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/* Purpose: reads the next instruction of a trace
+* Input:    reader -- the trace
+*           record -- set to the instruction
+*           broken -- set to whether the trace is cut short, at its end
+* Output:   false at the end of the trace
+*/
+bool trace_read(trace_reader_T reader, struct trace_record *record,
+                bool *broken)
+{
+        int header = getc(reader->file);
+
+        *broken = false;
+        if (header == EOF) {
+                return false;
+        }
+        if (header & ~(0xF0 | JUMPED | WROTE)) {
+                *broken = true;
+                return false;
+        }
+
+        uint64_t value = 0;
+
+        record->op_code = header >> 4;
+        record->pc = reader->last_pc + 1;
+        record->wrote = (header & WROTE) != 0;
+        record->reg = 0;
+        record->value = 0;
+
+        if (header & JUMPED) {
+                if (!get_varint(reader->file, &value) || value > UINT32_MAX) {
+                        *broken = true;
+                        return false;
+                }
+                record->pc += unzigzag(value);
+        }
+
+        if (record->wrote) {
+                if (!get_varint(reader->file, &value) ||
+                    (value >> 3) > UINT32_MAX) {
+                        *broken = true;
+                        return false;
+                }
+                record->reg = value & 0x7;
+                record->value = reader->registers[record->reg] +
+                                unzigzag(value >> 3);
+                reader->registers[record->reg] = record->value;
+        }
+
+        reader->last_pc = record->pc;
+        return true;
+}
+
+/* Purpose: closes a trace opened for reading
+* Input:    reader -- the trace
+* Output:   none
+*/
+void trace_reader_close(trace_reader_T reader)
+{
+        fclose(reader->file);
+        free(reader);
+}
+
+#undef MAGIC
+#undef MAGIC_LEN
+#undef CHUNK_SIZE
+#undef NUM_CHUNKS
+#undef NUM_REGISTERS
+#undef MAX_RECORD
+#undef JUMPED
+#undef WROTE
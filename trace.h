@@ -0,0 +1,73 @@
+/********************************************************************
+ *
+ *                     trace.h
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Interface for the trace module. Writes a log of every
+ *     instruction a machine executes, its pc, its opcode and the
+ *     register it changed, for "um --trace", and reads such a log
+ *     back for um_replay. The run loop only calls in here when um is
+ *     built with "make TRACE=1".
+ ********************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef TRACE
+#define TRACE
+
+typedef struct trace_T *trace_T;
+typedef struct trace_reader_T *trace_reader_T;
+
+/* One executed instruction. */
+struct trace_record {
+        uint32_t pc;
+        unsigned op_code;
+
+        /* whether a register changed, and which to what */
+        bool wrote;
+        unsigned reg;
+        uint32_t value;
+};
+
+/* Starts a trace of a machine that has all its registers 0, as a new
+ * one does; NULL with the error reported on stderr if path can't be
+ * written. */
+trace_T trace_open(const char *path);
+
+/* Records that the instruction at pc, with opcode op_code, is about to
+ * run; registers are the machine's registers as they are now, after
+ * the instruction before it. */
+void trace_step(trace_T trace, uint32_t pc, unsigned op_code,
+                const uint32_t *registers);
+
+/* Records what the last instruction traced did, when the run loop stops
+ * after it; ran is false if it didn't run, as for an Input with no input
+ * yet or an Output with no room, and will be traced again when the
+ * machine carries on. */
+void trace_pause(trace_T trace, const uint32_t *registers, bool ran);
+
+/* Writes out the rest of the trace and frees it; false with the error
+ * reported on stderr if any of it couldn't be written. */
+bool trace_close(trace_T trace);
+
+/* Opens a trace for reading; NULL with the error reported on stderr if it
+ * can't be read. */
+trace_reader_T trace_reader_open(const char *path);
+
+/* Reads the next instruction; false at the end of the trace, with
+ * *broken set if the trace ends partway through a record. */
+bool trace_read(trace_reader_T reader, struct trace_record *record,
+                bool *broken);
+
+/* Closes a trace opened for reading. */
+void trace_reader_close(trace_reader_T reader);
+
+#endif
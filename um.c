@@ -8,430 +8,984 @@
  *
  *     Purpose:
  *     
- *     Implementation for um module. Contains the struct definition
- *     for our Universal Machine and the functions necessary to 
- *     perform each instruction.
+ *     Implementation for um module. Contains the run loop that
+ *     performs each instruction, the predecoding of m[0] it runs
+ *     from, and the functions that create, run and free a machine.
+ *     Nothing here is shared between machines except tables built
+ *     once and never changed.
  ********************************************************************/
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
-#include <bitpack.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "um.h"
-#include <seq.h>
+#include "memory_segment.h"
+#include "io.h"
+#include "jit.h"
+#include "snapshot.h"
+#include "trace.h"
+
+#ifdef UM_PROFILE
+/* Counts an instruction when running with --profile. */
+#define PROFILE_COUNT(pc, op_code)                                       \
+        do {                                                             \
+                if (um->profile != NULL) {                               \
+                        profile_count(um->profile, (pc), (op_code));     \
+                }                                                        \
+        } while (0)
+
+/* Resizes the per-PC counters when m[0] is replaced. */
+#define PROFILE_PROGRAM(length)                                          \
+        do {                                                             \
+                if (um->profile != NULL) {                               \
+                        profile_program(um->profile, (length));          \
+                }                                                        \
+        } while (0)
+#else
+#define PROFILE_COUNT(pc, op_code)
+#define PROFILE_PROGRAM(length)
+#endif
+
+#ifdef UM_TRACE
+/* Traces an instruction when running with --trace. */
+#define TRACE_STEP(pc, op_code, r)                                       \
+        do {                                                             \
+                if (um->trace != NULL) {                                 \
+                        trace_step(um->trace, (pc), (op_code), (r));     \
+                }                                                        \
+        } while (0)
+
+/* Traces the last instruction as the run loop stops. */
+#define TRACE_PAUSE(r, status)                                           \
+        do {                                                             \
+                if (um->trace != NULL) {                                 \
+                        trace_pause(um->trace, (r),                      \
+                                    (status) != UM_NEEDS_INPUT &&        \
+                                    (status) != UM_OUTPUT_FULL);         \
+                }                                                        \
+        } while (0)
+#else
+#define TRACE_STEP(pc, op_code, r)
+#define TRACE_PAUSE(r, status)
+#endif
 
 #define NUM_REGISTERS 8
 #define OP_CODE_LEN 4
 #define REGISTER_LEN 3
 #define VALUE_LEN 25
-#define HINT 100
 
-struct um_T {
-        mem_T memory;
-        uint32_t registers[NUM_REGISTERS];
-        uint32_t program_counter;
-        unsigned ra, rb, rc;
-};
 
-struct mem_T {
-        Seq_T mapped_ids;
-        Seq_T unmapped_ids;
-};
+/* 
+ * One word of m[0] with its fields already pulled apart. Load Value keeps
+ * its register in ra and its 25-bit immediate in value.
+ */
+typedef struct inst_T {
+        uint8_t op_code;
+        uint8_t ra, rb, rc;
+        uint32_t value;
+} inst_T;
 
-struct seg_T {
-        uint32_t *segments; 
-        int seg_length;
-};
 
+/* Purpose: splits an instruction word into its opcode, registers and
+*           immediate value
+* Input:    word -- a 32-bit UM instruction
+* Output:   the decoded instruction
+*/
+static inline inst_T decode_word(uint32_t word)
+{
+        inst_T inst;
+
+        inst.op_code = word >> 28;
+
+        if (inst.op_code == 13) {
+                inst.ra = word << OP_CODE_LEN >> 29;
+                inst.rb = 0;
+                inst.rc = 0;
+                inst.value = word << 7 >> 7;
+        } else {
+                inst.ra = word << 23 >> 29;
+                inst.rb = word << 26 >> 29;
+                inst.rc = word & 0x7;
+                inst.value = 0;
+        }
+
+        return inst;
+}
 
-/* MEMORY FUNCTIONS */
+#ifdef UM_THREADED_DISPATCH
+
+/*
+ * Runs of opcodes that the threaded run loop executes with one dispatch,
+ * picked from the hot pairs and triples "um --profile" reports for
+ * midmark, sandmark and a codex session. Fused handler FIRST_FUSED + i
+ * runs fusions[i], and run_um's handler table lists them in that order.
+ * Only the first word of a run gets the fused op_code, so a jump into the
+ * middle of a run still finds each word decoded on its own.
+ */
+#define FIRST_FUSED 16
+#define NUM_FUSIONS 15
+
+static const uint8_t fusions[NUM_FUSIONS][4] = {
+        /* length, then opcodes */
+        { 3, 13, 1, 13 },       /* loadv sload loadv */
+        { 3, 13, 2, 13 },       /* loadv sstore loadv */
+        { 3, 6, 3, 13 },        /* nand add loadv */
+        { 3, 3, 13, 3 },        /* add loadv add */
+        { 2, 13, 1, 0 },        /* loadv sload */
+        { 2, 13, 2, 0 },        /* loadv sstore */
+        { 2, 1, 13, 0 },        /* sload loadv */
+        { 2, 2, 13, 0 },        /* sstore loadv */
+        { 2, 3, 13, 0 },        /* add loadv */
+        { 2, 13, 3, 0 },        /* loadv add */
+        { 2, 6, 3, 0 },         /* nand add */
+        { 2, 13, 12, 0 },       /* loadv loadp */
+        { 2, 13, 13, 0 },       /* loadv loadv */
+        { 2, 6, 6, 0 },         /* nand nand */
+        { 2, 13, 6, 0 }         /* loadv nand */
+};
 
-/* Purpose: To create an instance of our memory struct
-* Input: none
-* Output: an instance of mem_T, our memory struct
+/* fused op_codes by the opcodes of a run, 0 where there is none */
+static uint8_t pair_fused[16][16];
+static uint8_t triple_fused[16][16][16];
+
+/* Purpose: fills in the lookup tables from fusions; run once, by the
+*           first um_new()
+* Input:    none
+* Output:   none
 */
-mem_T mem_new() 
+static void build_fusions()
 {
-        mem_T memory = malloc(sizeof(*memory));
-        memory->mapped_ids = Seq_new(HINT);
-        memory->unmapped_ids = Seq_new(HINT);
+        for (int i = 0; i < NUM_FUSIONS; i++) {
+                const uint8_t *f = fusions[i];
 
-        return memory;
+                if (f[0] == 3) {
+                        triple_fused[f[1]][f[2]][f[3]] = FIRST_FUSED + i;
+                } else {
+                        pair_fused[f[1]][f[2]] = FIRST_FUSED + i;
+                }
+        }
 }
 
-/* Purpose: To free all heap allocated memory from memory struct
-* Input: mem_segments -- the memory struct containing our sequences
-* Output: none
+/* Purpose: gives words first to last of the decoded program the fused
+*           handler for the run starting there, if any, and their own
+*           handler otherwise. Triples win over pairs.
+* Input:    um -- our Universal Machine
+*           first, last -- the range of words, inclusive
+* Output:   none
 */
-void mem_free(mem_T mem_segments) 
+static inline void fuse_words(um_T um, uint32_t first, uint32_t last)
 {
-        uint32_t length = Seq_length(mem_segments->mapped_ids);
-        
-        /* Frees the array of words inside the memory segment. */
-        for (uint32_t i = 0; i < length; i++) {
-            if (Seq_get(mem_segments->mapped_ids, i) != NULL) {
-                seg_T delete_segment = Seq_get(mem_segments->mapped_ids, i);
+#ifdef UM_PROFILE
+        /* The profile counts every instruction, so nothing is fused. */
+        if (um->profile != NULL) {
+                return;
+        }
+#endif
+#ifdef UM_TRACE
+        /* So is the trace. */
+        if (um->trace != NULL) {
+                return;
+        }
+#endif
+        /* Compiled code is picked up again after each store, map, unmap
+         * and I/O, which the fused handlers don't do, so a fused run would
+         * keep the machine in the interpreter until the next jump. */
+        if (um->jit != NULL) {
+                return;
+        }
+
+        seg_T m0 = um->memory->mapped_ids[0];
+        const uint32_t *words = m0->segments;
+        uint32_t length = m0->seg_length;
+
+        for (uint32_t pc = first; pc <= last && pc < length; pc++) {
+                unsigned op_code = words[pc] >> 28;
+                uint8_t fused = 0;
+
+                if (pc + 2 < length) {
+                        fused = triple_fused[op_code][words[pc + 1] >> 28]
+                                                     [words[pc + 2] >> 28];
+                }
+                if (fused == 0 && pc + 1 < length) {
+                        fused = pair_fused[op_code][words[pc + 1] >> 28];
+                }
 
-                free(delete_segment->segments);
-                free(delete_segment);
-            }
+                um->program[pc].op_code = (fused != 0) ? fused : op_code;
         }
+}
+
+#else
+
+static inline void build_fusions()
+{
+}
 
-        Seq_free(&(mem_segments->mapped_ids));
-        Seq_free(&(mem_segments->unmapped_ids));
-        free(mem_segments);
+static inline void fuse_words(um_T um, uint32_t first, uint32_t last)
+{
+        (void)um;
+        (void)first;
+        (void)last;
 }
 
-/* Purpose: To map a segment of memory
-* Input: mem_segments -- our memory struct containing our sequences
-*        num_words -- the size of the memory segment 
-* Output: none
-* It is a checked runtime error to try to map more than 2^32 segments.
+#endif
+
+/* Purpose: decodes every word of m[0] into um->program. Called whenever
+*           m[0] is replaced; single stores into m[0] are redecoded by
+*           redecode() instead.
+* Input:    um -- our Universal Machine, with its program in m[0]
+* Output:   none
 */
-uint32_t map_segment(mem_T mem_segments, uint32_t num_words)
+static void decode_program(um_T um)
 {
-        seg_T new_segment = malloc(sizeof(*new_segment));
-        assert(new_segment != NULL);
+        seg_T m0 = um->memory->mapped_ids[0];
 
-        uint32_t *new_seg = calloc((num_words), sizeof(new_seg));
-        assert(new_seg != NULL);
+        free(um->program);
+        um->program = malloc((m0->seg_length + 1) * sizeof(*um->program));
+        assert(um->program != NULL);
 
-        new_segment->segments = new_seg;
-        new_segment->seg_length = num_words;
+        for (uint32_t i = 0; i < m0->seg_length; i++) {
+                um->program[i] = decode_word(m0->segments[i]);
+        }
 
-        uint32_t new_id;
-        
-        /* Attempts to reuse an unmapped segment identifier. */
-        if (Seq_length(mem_segments->unmapped_ids) != 0) {
-                new_id = (uint32_t)(uintptr_t)
-                         Seq_remlo(mem_segments->unmapped_ids);
+        if (m0->seg_length > 0) {
+                fuse_words(um, 0, m0->seg_length - 1);
+        }
 
-                Seq_put(mem_segments->mapped_ids, new_id, new_segment);
-        } else {
-                new_id = Seq_length(mem_segments->mapped_ids);
+        PROFILE_PROGRAM(m0->seg_length);
 
-                Seq_addhi(mem_segments->mapped_ids, new_segment);
+        if (um->jit != NULL) {
+                jit_program(um->jit, m0->seg_length);
         }
-
-        return new_id;
 }
 
-/* Purpose: To unmap a segment of memory
-* Input: mem_segments -- our memory struct containing our sequences
-*        id -- the memory segment's identifier
-* Output: none
+/* Purpose: redecodes a word of m[0] after a store into it, along with
+*           the words before it whose fused runs might include it
+* Input:    um -- our Universal Machine
+*           index -- the word stored into
+* Output:   none
 */
-void unmap_segment(mem_T mem_segments, uint32_t id)
+static inline void redecode(um_T um, uint32_t index)
 {
-        seg_T delete_segment = Seq_get(mem_segments->mapped_ids, id);
-        assert(delete_segment != NULL);
-
-        free(delete_segment->segments);
-        free(delete_segment);
-        
-        Seq_put(mem_segments->mapped_ids, id, NULL);
-        Seq_addlo(mem_segments->unmapped_ids, (void *)(uintptr_t)id);
+        um->program[index] = decode_word(um->memory->mapped_ids[0]->
+                                                        segments[index]);
+        fuse_words(um, (index >= 2) ? index - 2 : 0, index);
 }
 
-/* Purpose: Creates the program m[0] and adds it to mapped ids
-* Input: mem_segments -- our memory struct containing our sequences
-*        instructions -- the stream of instructions for the UM
-* Output: none
+/* Purpose: redecodes a word of m[0] that compiled code stored into
+* Input:    cl -- our Universal Machine
+*           index -- the word stored into
+* Output:   none
 */
-void initalize_program(mem_T mem_segments, Seq_T instructions)
+static void redecode_word(void *cl, uint32_t index)
 {
-        seg_T program = malloc(sizeof(*program));
-        assert(program != NULL);
-        
-        uint32_t *m0 = calloc(Seq_length(instructions), sizeof(m0));
-        assert(m0 != NULL);
+        redecode(cl, index);
+}
 
+/* Purpose: looks up a segment that is about to be stored into, first
+*           copying it if another identifier shares it
+* Input:    memory -- the UM's memory
+*           id -- the identifier of the segment
+* Output:   a segment mapped only at id
+*/
+static inline seg_T writable_segment(mem_T memory, uint32_t id)
+{
+        seg_T segment = segment_at(memory, id);
 
-        /* Copy the instructions from the stream of instructions into the 
-         * program. */
-        for (int i = 0; i < Seq_length(instructions); i++) {
-                m0[i] = (uint32_t)(uintptr_t)Seq_get(instructions, i);
+        if (segment->refs > 1) {
+                segment = unshare_segment(memory, id);
         }
 
-        program->segments = m0;
-        program->seg_length = Seq_length(instructions);
-
-        Seq_addhi(mem_segments->mapped_ids, program);
+        return segment;
 }
 
-/* Purpose: loads a value from a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
-*                  id -- the memory segment identifier
-*                  index -- the index within the memory segment
-* Output: the value stored in the memory segment
+/* Purpose: keeps the decoded program, any compiled code and any watcher
+*           in step with a store into m[0]
+* Input:    um -- our Universal Machine
+*           index -- the word stored into
+*           old_word, word -- what it held before, and holds now
+* Output:   none
 */
-uint32_t segmented_load(mem_T mem_segments, uint32_t id, uint32_t index)
+static void stored_into_m0(um_T um, uint32_t index, uint32_t old_word,
+                           uint32_t word)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        assert(segment != NULL);
+        /* Fusion only looks at opcodes, so a store that keeps the opcode
+         * keeps the handler too. */
+        if ((old_word ^ word) >> 28 == 0) {
+                uint8_t op_code = um->program[index].op_code;
+
+                um->program[index] = decode_word(word);
+                um->program[index].op_code = op_code;
+        } else {
+                redecode(um, index);
+        }
 
-        return segment->segments[index];
+        if (um->jit != NULL) {
+                jit_store(um->jit, index);
+        }
+        if (um->program_changed != NULL && old_word != word) {
+                um->program_changed(um->program_changed_cl, index);
+        }
 }
 
-/* Purpose: stores a value into a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
-*                  id -- the memory segment identifier
-*                  index -- the index within the memory segment
-*                  word -- value to store
-* Output: None
+/* Purpose: carries out a Segmented Store
+* Input:    um -- our Universal Machine
+*           id, index -- where to store
+*           word -- what to store
+* Output:   none
 */
-void segmented_store(mem_T mem_segments, uint32_t id, uint32_t index, 
-                     uint32_t word)
+static inline void store_word(um_T um, uint32_t id, uint32_t index,
+                              uint32_t word)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        assert(segment != NULL);
+        seg_T segment = writable_segment(um->memory, id);
+        uint32_t old_word = segment->segments[index];
 
         segment->segments[index] = word;
-}
 
-/* Purpose: loads a new program m[0] from a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
-*                  id -- the memory segment identifier
-* Output: None
-* Effects: changes the running program
-*/
-void load_program(mem_T mem_segments, uint32_t id)
-{
         if (id == 0) {
-                return;
+                stored_into_m0(um, index, old_word, word);
         }
+}
 
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        
-        unmap_segment(mem_segments, 0);
+/* Purpose: runs compiled code from a jump target, lending it the run
+*           loop's copy of the registers. Compiled code is entered at
+*           every jump and after every instruction it hands back, so the
+*           registers are lent in place rather than copied into um and
+*           back each time.
+* Input:    um -- our Universal Machine, with a compiler
+*           r -- the run loop's registers
+*           pc -- where to start
+*           executed, limit -- the run loop's instruction count and budget
+* Output:   the pc at which the interpreter should carry on
+*/
+static inline uint32_t run_compiled(um_T um, uint32_t *r, uint32_t pc,
+                                    uint64_t *executed, uint64_t limit)
+{
+        return jit_run(um->jit, um->memory, r, pc, executed, limit,
+                       &um->preempt);
+}
 
-        uint32_t new_id = map_segment(mem_segments, segment->seg_length);
-        seg_T new_m0 = Seq_get(mem_segments->mapped_ids, new_id);
+/* Purpose: saves the machine for --snapshot-at-input
+* Input:    um -- our Universal Machine, its registers and program
+*                 counter up to date
+* Output:   none
+*/
+static void take_snapshot(um_T um)
+{
+        /* Output so far belongs before the snapshot. */
+        output_flush(um->io);
 
-        /* Copy the instructions from segment into the new program. */
-        for (int i = 0; i < segment->seg_length; i++) {
-                new_m0->segments[i] = segment->segments[i];
+        if (snapshot_save(um->snapshot_path, um->memory, um->registers,
+                          um->program_counter)) {
+                fprintf(stderr, "snapshot saved to %s\n", um->snapshot_path);
         }
+
+        um->snapshot_path = NULL;
 }
 
-/* Purpose: gets the length of a segment in memory
-* Input: mem_segments -- our memory struct containing our sequences
-*                  id -- the memory segment identifier
-* Output: the length of the memory segment
+/* Purpose: saves the machine the first time it reaches an Input, so that
+*           a restored machine carries on by executing that Input
+* Input:    um -- our Universal Machine, with a snapshot still to take
+*           r -- the run loop's registers
+*           pc -- the Input's program counter
+* Output:   none
 */
-uint32_t segment_length(mem_T mem_segments, uint32_t id)
+static inline void snapshot_at_input(um_T um, const uint32_t *r, uint32_t pc)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        return segment->seg_length;
+        memcpy(um->registers, r, sizeof(um->registers));
+        um->program_counter = pc;
+        take_snapshot(um);
 }
 
-/* Purpose: gets the word stored in a memory segment
-* Input: mem_segments -- our memory struct containing our sequences
-*                  id -- the memory segment identifier
-*               index -- the index within the memory segment
-* Output: the word stored in the memory segment
+#ifndef UM_THREADED_DISPATCH
+
+/* Purpose: runs the UM until it halts or runs off the end of m[0],
+*           choosing each instruction's handler with a chain of tests.
+*           The program counter, the decoded program and the registers
+*           are kept in locals, which segment stores can't alias, and
+*           written back to um when the loop ends. Instructions are
+*           counted a straight run at a time, from where the last jump
+*           landed to the next jump.
+* Input:    um -- our Universal Machine, with its program in m[0]
+*           limit -- stop at the first Load Program once this many
+*                    instructions have run, or once um->preempt is set
+* Output:   UM_HALTED, UM_NEEDS_INPUT, UM_OUTPUT_FULL, UM_BUDGET_EXHAUSTED
+*           or UM_PREEMPTED
 */
-uint32_t segment_word(mem_T mem_segments, uint32_t id, int index)
+static int run_um(um_T um, uint64_t limit)
 {
-        seg_T segment = Seq_get(mem_segments->mapped_ids, id);
-        return segment->segments[index];
-}
+        uint32_t program_length = um->memory->mapped_ids[0]->seg_length;
+        inst_T *program = um->program;
+        uint32_t pc = um->program_counter;
+        uint32_t run_start = pc;
+        uint64_t executed = 0;
+        int status = UM_HALTED;
+        uint32_t r[NUM_REGISTERS];
+
+        memcpy(r, um->registers, sizeof(r));
 
-/* UM FUNCTIONS */
+        /* UM will keep executing commands until it reaches the end of m[0]. */
+        while (pc < program_length) {
+
+                inst_T inst = program[pc];
+                uint32_t op_code = inst.op_code;
+
+                PROFILE_COUNT(pc, op_code);
+                TRACE_STEP(pc, op_code, r);
+
+                if (op_code == 7) {
+                        executed++;
+                        break;
+                }
+
+                if (op_code == 0) { 
+                        if (r[inst.rc] != 0) {
+                                r[inst.ra] = r[inst.rb];
+                        }
+                } else if (op_code == 1) { 
+                        r[inst.ra] = segment_at(um->memory, r[inst.rb])->
+                                                        segments[r[inst.rc]];
+                } else if (op_code == 2){
+                        store_word(um, r[inst.ra], r[inst.rb], r[inst.rc]);
+                } else if (op_code == 3) { 
+                        r[inst.ra] = r[inst.rb] + r[inst.rc]; 
+                } else if (op_code == 4) {
+                        r[inst.ra] = r[inst.rb] * r[inst.rc];
+                } else if (op_code == 5) {
+                        r[inst.ra] = r[inst.rb] / r[inst.rc];
+                } else if (op_code == 6) {
+                        r[inst.ra] = ~(r[inst.rb] & r[inst.rc]);
+                } else if (op_code == 8) {
+                        r[inst.rb] = map_segment(um->memory, r[inst.rc]);
+                } else if (op_code == 9) {
+                        unmap_segment(um->memory, r[inst.rc]);
+                } else if (op_code == 10) { 
+                        if (!output(um->io, r[inst.rc])) {
+                                status = UM_OUTPUT_FULL;
+                                break;
+                        }
+                } else if (op_code == 11) {
+                        if (!input_ready(um->io)) {
+                                status = UM_NEEDS_INPUT;
+                                break;
+                        }
+                        if (um->snapshot_path != NULL) {
+                                snapshot_at_input(um, r, pc);
+                        }
+                        r[inst.rc] = input(um->io);
+                } else if (op_code == 12){ 
+                        executed += pc - run_start + 1;
+
+                        if (r[inst.rb] != 0 && 
+                            load_program(um->memory, r[inst.rb])) {
+                                decode_program(um);
+                                program = um->program;
+                        }
+                        pc = r[inst.rc];
+                        run_start = pc;
+                } else if (op_code == 13){
+                        r[inst.ra] = inst.value;
+                } else {
+                        /* Ensures that the instruction is valid; only
+                         * words that aren't instructions get this far. */
+                        assert(op_code < 14);
+                        executed++;
+                        break;
+                }
+
+                /* If a new program is loaded, make sure that the program 
+                 * length is changed. */
+                if (op_code == 12) {
+                        program_length = um->memory->mapped_ids[0]->seg_length;
 
-/* Purpose: To create an instance of the um_T struct (the Machine)
-*           in its initial state
-* Input: instructions -- Seq_T stream of instructions for the UM
-*        
-* Output: an instance of the um
+                        /* Checked before compiled code runs, which can
+                         * hand back in the middle of a block. */
+                        if (um->preempt) {
+                                status = UM_PREEMPTED;
+                                break;
+                        }
+                        if (executed >= limit) {
+                                status = UM_BUDGET_EXHAUSTED;
+                                break;
+                        }
+
+                        /* Jump targets are where compiled blocks start. */
+                        if (um->jit != NULL) {
+                                pc = run_compiled(um, r, pc, &executed,
+                                                  limit);
+                                run_start = pc;
+                        }
+                        continue;
+                }
+
+                pc++;
+
+                /* Compiled code hands these back to us; pick it up again
+                 * straight after them. */
+                if (um->jit != NULL &&
+                    (op_code == 2 || (op_code >= 8 && op_code <= 11))) {
+                        executed += pc - run_start;
+                        pc = run_compiled(um, r, pc, &executed, limit);
+                        run_start = pc;
+                }
+        }
+
+        TRACE_PAUSE(r, status);
+        executed += pc - run_start;
+        um->instructions += executed;
+        um->program_counter = pc;
+        memcpy(um->registers, r, sizeof(r));
+
+        return status;
+}
+
+#else
+
+/* 
+ * Taking the address of a label and jumping through a pointer are GNU
+ * extensions, which -pedantic would otherwise turn into errors.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/* Purpose: runs the UM until it halts or runs off the end of m[0],
+*           jumping straight to each instruction's handler through a
+*           table of label addresses. Every handler ends with its own
+*           copy of the dispatch, so the branch predictor learns each
+*           opcode's likely successor separately. As in the branching
+*           engine, the program counter, decoded program and registers
+*           live in locals until the loop ends, and instructions are
+*           counted a straight run at a time.
+* Input:    um -- our Universal Machine, with its program in m[0]
+*           limit -- stop at the first Load Program once this many
+*                    instructions have run, or once um->preempt is set
+* Output:   UM_HALTED, UM_NEEDS_INPUT, UM_OUTPUT_FULL, UM_BUDGET_EXHAUSTED
+*           or UM_PREEMPTED
 */
-static inline um_T initalize_um(Seq_T instructions)
+static int run_um(um_T um, uint64_t limit)
 {
-        um_T um;
+        static const void *handlers[32] = {
+                &&conditional_move, &&segmented_load, &&segmented_store,
+                &&addition, &&multiplication, &&division, &&bitwise_nand,
+                &&halt, &&map_segment, &&unmap_segment, &&output,
+                &&input, &&load_program, &&load_value,
+                &&invalid, &&invalid,
+
+                /* in the order of fusions[] */
+                &&loadv_sload_loadv, &&loadv_sstore_loadv,
+                &&nand_add_loadv, &&add_loadv_add,
+                &&loadv_sload, &&loadv_sstore, &&sload_loadv,
+                &&sstore_loadv, &&add_loadv, &&loadv_add, &&nand_add,
+                &&loadv_loadp, &&loadv_loadv, &&nand_nand, &&loadv_nand,
+                &&invalid
+        };
+
+        inst_T *inst;
+        uint32_t program_length = um->memory->mapped_ids[0]->seg_length;
+        inst_T *program = um->program;
+        uint32_t pc = um->program_counter;
+        uint32_t run_start = pc;
+        uint64_t executed = 0;
+        int status = UM_HALTED;
+        uint32_t r[NUM_REGISTERS];
+
+        memcpy(r, um->registers, sizeof(r));
+
+/* Fetches the instruction at the program counter and jumps to it. */
+#define DISPATCH()                                                       \
+        do {                                                             \
+                if (pc >= program_length) {                              \
+                        goto stop;                                       \
+                }                                                        \
+                inst = &program[pc];                                     \
+                PROFILE_COUNT(pc, inst->op_code);                        \
+                TRACE_STEP(pc, inst->op_code, r);                        \
+                goto *handlers[inst->op_code];                           \
+        } while (0)
+
+/* Moves past n instructions and dispatches the next one. */
+#define SKIP(n)                                                          \
+        do {                                                             \
+                pc += (n);                                               \
+                DISPATCH();                                              \
+        } while (0)
+
+#define NEXT() SKIP(1)
+
+/* Like SKIP(), but first lets compiled code carry on after one of the
+ * instructions that it hands back to the interpreter. */
+#define RESUME(n)                                                        \
+        do {                                                             \
+                pc += (n);                                               \
+                if (um->jit != NULL) {                                   \
+                        executed += pc - run_start;                      \
+                        pc = run_compiled(um, r, pc, &executed, limit);  \
+                        run_start = pc;                                  \
+                }                                                        \
+                DISPATCH();                                              \
+        } while (0)
+
+/* The work of single instructions, shared with the fused handlers. */
+#define LOAD(i) (r[(i)->ra] = segment_at(um->memory, r[(i)->rb])->      \
+                                                segments[r[(i)->rc]])
+#define STORE(i) store_word(um, r[(i)->ra], r[(i)->rb], r[(i)->rc])
+#define ADD(i) (r[(i)->ra] = r[(i)->rb] + r[(i)->rc])
+#define NAND(i) (r[(i)->ra] = ~(r[(i)->rb] & r[(i)->rc]))
+#define VALUE(i) (r[(i)->ra] = (i)->value)
+
+/* A store into m[0] may have rewritten the rest of a fused run, so after
+ * one the run carries on through the ordinary dispatch. */
+#define STORED_INTO_M0(i) (r[(i)->ra] == 0)
+
+        DISPATCH();
+
+conditional_move:
+        if (r[inst->rc] != 0) {
+                r[inst->ra] = r[inst->rb];
+        }
+        NEXT();
+segmented_load:
+        LOAD(inst);
+        NEXT();
+segmented_store:
+        STORE(inst);
+        RESUME(1);
+addition:
+        ADD(inst);
+        NEXT();
+multiplication:
+        r[inst->ra] = r[inst->rb] * r[inst->rc];
+        NEXT();
+division:
+        r[inst->ra] = r[inst->rb] / r[inst->rc];
+        NEXT();
+bitwise_nand:
+        NAND(inst);
+        NEXT();
+halt:
+        executed++;
+        goto stop;
+map_segment:
+        r[inst->rb] = map_segment(um->memory, r[inst->rc]);
+        RESUME(1);
+unmap_segment:
+        unmap_segment(um->memory, r[inst->rc]);
+        RESUME(1);
+output:
+        if (!output(um->io, r[inst->rc])) {
+                status = UM_OUTPUT_FULL;
+                goto stop;
+        }
+        RESUME(1);
+input:
+        if (!input_ready(um->io)) {
+                status = UM_NEEDS_INPUT;
+                goto stop;
+        }
+        if (um->snapshot_path != NULL) {
+                snapshot_at_input(um, r, pc);
+        }
+        r[inst->rc] = input(um->io);
+        RESUME(1);
+load_program:
+        executed += (uint32_t)(inst - program) - run_start + 1;
+
+        /* Read the target first: decoding a new m[0] frees inst. */
+        pc = r[inst->rc];
+
+        if (r[inst->rb] != 0 && load_program(um->memory, r[inst->rb])) {
+                decode_program(um);
+                program = um->program;
+                program_length = um->memory->mapped_ids[0]->seg_length;
+        }
 
-        um.memory = mem_new();
+        run_start = pc;
 
-        initalize_program(um.memory, instructions);
+        /* Checked before compiled code runs, which can hand back in the
+         * middle of a block. */
+        if (um->preempt) {
+                status = UM_PREEMPTED;
+                goto stop;
+        }
+        if (executed >= limit) {
+                status = UM_BUDGET_EXHAUSTED;
+                goto stop;
+        }
 
-        for (int i = 0; i < NUM_REGISTERS; i++) {
-                um.registers[i] = 0;
+        /* Jump targets are where compiled blocks start. */
+        if (um->jit != NULL) {
+                pc = run_compiled(um, r, pc, &executed, limit);
+                run_start = pc;
+        }
+        DISPATCH();
+load_value:
+        VALUE(inst);
+        NEXT();
+invalid:
+        /* Ensures that the instruction is valid. */
+        assert(inst->op_code < 14);
+        executed++;
+        goto stop;
+
+loadv_sload_loadv:
+        VALUE(inst);
+        LOAD(inst + 1);
+        VALUE(inst + 2);
+        SKIP(3);
+loadv_sstore_loadv:
+        VALUE(inst);
+        STORE(inst + 1);
+        if (STORED_INTO_M0(inst + 1)) {
+                RESUME(2);
+        }
+        VALUE(inst + 2);
+        RESUME(3);
+nand_add_loadv:
+        NAND(inst);
+        ADD(inst + 1);
+        VALUE(inst + 2);
+        SKIP(3);
+add_loadv_add:
+        ADD(inst);
+        VALUE(inst + 1);
+        ADD(inst + 2);
+        SKIP(3);
+loadv_sload:
+        VALUE(inst);
+        LOAD(inst + 1);
+        SKIP(2);
+loadv_sstore:
+        VALUE(inst);
+        STORE(inst + 1);
+        RESUME(2);
+sload_loadv:
+        LOAD(inst);
+        VALUE(inst + 1);
+        SKIP(2);
+sstore_loadv:
+        STORE(inst);
+        if (STORED_INTO_M0(inst)) {
+                RESUME(1);
         }
+        VALUE(inst + 1);
+        RESUME(2);
+add_loadv:
+        ADD(inst);
+        VALUE(inst + 1);
+        SKIP(2);
+loadv_add:
+        VALUE(inst);
+        ADD(inst + 1);
+        SKIP(2);
+nand_add:
+        NAND(inst);
+        ADD(inst + 1);
+        SKIP(2);
+loadv_loadp:
+        VALUE(inst);
+        inst++;
+        goto load_program;
+loadv_loadv:
+        VALUE(inst);
+        VALUE(inst + 1);
+        SKIP(2);
+nand_nand:
+        NAND(inst);
+        NAND(inst + 1);
+        SKIP(2);
+loadv_nand:
+        VALUE(inst);
+        NAND(inst + 1);
+        SKIP(2);
+
+stop:
+        TRACE_PAUSE(r, status);
+        executed += pc - run_start;
+        um->instructions += executed;
+        um->program_counter = pc;
+        memcpy(um->registers, r, sizeof(r));
+
+        return status;
+
+#undef STORED_INTO_M0
+#undef VALUE
+#undef NAND
+#undef ADD
+#undef STORE
+#undef LOAD
+#undef RESUME
+#undef NEXT
+#undef SKIP
+#undef DISPATCH
+}
 
-        um.program_counter = 0;
+#pragma GCC diagnostic pop
 
-        return um;
-} 
+#endif
 
-/* Purpose: takes the instruction bit and extracts the register values
-* Input: instruction -- 32-bit encodings which tell the UM what to do
-*        um -- our Universal Machine struct containing our memory
-*        and register information
-* Output: none
+static pthread_once_t fusions_built = PTHREAD_ONCE_INIT;
+
+/* Purpose: creates a machine with empty memory and no program, reading
+*           stdin and writing stdout
+* Input:    none
+* Output:   the new machine
 */
-static inline void set_three_registers(uint32_t instruction, um_T *um)
+um_T um_new()
 {
-        um->ra = instruction << 23 >>29;
-        um->rb = instruction << 26 >> 29; //Bitpack_getu(instruction, REGISTER_LEN, REGISTER_LEN);
-        um->rc = instruction & 0x7; //Bitpack_getu(instruction, REGISTER_LEN, 0);
+        pthread_once(&fusions_built, build_fusions);
+
+        um_T um = calloc(1, sizeof(*um));
+        assert(um != NULL);
+
+        um->memory = mem_new();
+        um->io = io_new(STDIN_FILENO, STDOUT_FILENO, OUTPUT_BUFFER_SIZE);
+
+        return um;
 }
 
-/* Purpose: specifically for opcode 13, takes the instruction bit and 
-*           extracts specifically register A
-* Input: instruction -- 32-bit encodings which tell the UM what to do
-*        um -- our Universal Machine struct containing our memory
-*        and register information
-* Output: none
+/* Purpose: creates a machine ready to run a program
+* Input:    words -- the program, in host byte order
+*           num_words -- its length
+* Output:   the new machine
 */
-static inline uint32_t set_one_register(uint32_t instruction, um_T *um)
+um_T um_create(const uint32_t *words, uint32_t num_words)
 {
-        um->ra = instruction << OP_CODE_LEN >> 29; //Bitpack_getu(instruction, REGISTER_LEN, VALUE_LEN);
-        return instruction << 7 >> 7; //Bitpack_getu(instruction, VALUE_LEN, 0);
+        um_T um = um_new();
+
+        initalize_program(um->memory, words, num_words);
+        um_decode(um);
+
+        return um;
 }
 
-/* Purpose: getter function that returns the opcode by extracting
-*           the four most significant bits from the instruction word
-* Input:    uint32_t instruction -- 32 bit word 
-*        
-* Output:   returns the opcode
+/* Purpose: frees a machine and everything it holds, flushing its output
+* Input:    um -- the machine
+* Output:   none
 */
-static inline uint32_t get_opcode(uint32_t instruction)
+void um_destroy(um_T um)
 {
-        return instruction >> 28; //Bitpack_getu(instruction, OP_CODE_LEN, 28);
+        if (um->jit != NULL) {
+                jit_free(um->jit);
+        }
+        if (um->profile != NULL) {
+                profile_free(um->profile);
+        }
+        mem_free(um->memory);
+        io_free(um->io);
+        free(um->program);
+        free(um);
 }
 
+/* Purpose: replaces a machine's I/O devices
+* Input:    um -- the machine
+*           io -- the new devices, which the machine now owns
+* Output:   none
+*/
+void um_set_io(um_T um, io_T io)
+{
+        io_free(um->io);
+        um->io = io;
+}
 
-/* Purpose: runs whatever instruction is given to the UM
-*           
-* Input:   um -- our Universal Machine struct containing our memory
-*          and register information
-*          uint32_t instruction -- 32 bit word 
-*          uint32_t op_code -- contains command to be run     
-* Output:  none
+/* Purpose: starts compiling hot blocks of the machine's program
+* Input:    um -- the machine
+* Output:   false if compiling isn't supported here
 */
-static inline void execute_command(um_T *um, uint32_t instruction, 
-                                   uint32_t op_code)
+bool um_compile(um_T um)
 {
-        uint32_t value;
+        if (um->jit != NULL) {
+                return true;
+        }
 
-        switch (op_code)
-        {
-                case 0: 
-                        set_three_registers(instruction, um);
-                        if (um->registers[um->rc] != 0) {
-                                um->registers[um->ra] = um->registers[um->rb];
-                        }
-                        break;
-                case 1: 
-                        set_three_registers(instruction, um);
-                        um->registers[um->ra] = segmented_load(um->memory,
-                                                um->registers[um->rb], 
-                                                um->registers[um->rc]);
-                        break;
-                case 2: 
-                        set_three_registers(instruction, um);
-                        segmented_store(um->memory, um->registers[um->ra], 
-                        um->registers[um->rb], um->registers[um->rc]);
-                        break;
-                case 3: 
-                        set_three_registers(instruction, um);
-                        um->registers[um->ra] = um->registers[um->rb] + um->registers[um->rc]; 
-                        break;
-                case 4:
-                        set_three_registers(instruction, um);
-                        um->registers[um->ra] = um->registers[um->rb] * um->registers[um->rc];
-                        break;
-                case 5: 
-                        set_three_registers(instruction, um);
-                        um->registers[um->ra] = um->registers[um->rb] / um->registers[um->rc];
-                        break;
-                case 6: 
-                        set_three_registers(instruction, um);
-                        uint32_t rb_value = um->registers[um->rb];
-                        uint32_t rc_value = um->registers[um->rc];
-                        um->registers[um->ra] = ~(rb_value & rc_value);
-                        break;
-                case 8: 
-                        set_three_registers(instruction, um);
-                        um->registers[um->rb] = map_segment(um->memory, um->registers[um->rc]);
-                        break;
-                case 9: 
-                        set_three_registers(instruction, um);
-                        unmap_segment(um->memory, um->registers[um->rc]);
-                        break;
-                case 10: 
-                        set_three_registers(instruction, um);
-                        putchar(um->registers[um->rc]);
-                        break;
-                case 11: 
-                        set_three_registers(instruction, um);
-                        um->registers[um->rc] = getchar();
-                        break;
-                case 12: 
-                        set_three_registers(instruction, um);
-                        load_program(um->memory, um->registers[um->rb]);
-                        um->program_counter = um->registers[um->rc];
-                        break;
-                case 13: 
-                        value = set_one_register(instruction, um);
-                        um->registers[um->ra] = value;
-                        break;
+        um->jit = jit_new(redecode_word, um);
+        if (um->jit == NULL) {
+                return false;
         }
 
-        (void)value;
+        /* Decoded again without fusion, which compiling leaves off. */
+        if (um->program != NULL) {
+                decode_program(um);
+        }
+
+        return true;
 }
 
-/* Purpose: gets the length of the the program stored in m[0]
-* Input: um -- our Universal Machine struct containing our memory
-*        and register information
-* Output: the length of the program
+/* Purpose: has a machine report the words of m[0] that stores change
+* Input:    um -- the machine
+*           changed -- called with cl and the word's index after each
+*                      such store, or NULL to stop reporting
+*           cl -- passed to changed
+* Output:   none
 */
-static inline uint32_t get_program_length(um_T *um)
+void um_watch_program(um_T um, void changed(void *cl, uint32_t index),
+                      void *cl)
 {
-        return segment_length(um->memory, 0);
+        um->program_changed = changed;
+        um->program_changed_cl = cl;
 }
 
-
-/* Purpose: runs our UM program
-* Input: um -- our Universal Machine struct containing our memory
-*        and register information
-* Output: none
+/* Purpose: decodes the program that has been loaded into m[0]
+* Input:    um -- the machine
+* Output:   none
 */
-void run_um(Seq_T instructions)
+void um_decode(um_T um)
 {
-        uint32_t um_instruction;
-
-        um_T um = initalize_um(instructions);
-        uint32_t program_length = get_program_length(&um);
+        decode_program(um);
+}
 
-        /* UM will keep executing commands until it reaches the end of m[0]. */
-        while (um.program_counter < program_length) {
+/* Purpose: stores a word on behalf of code translated from the machine's
+*           program, as a Segmented Store would
+* Input:    um -- the machine
+*           id, index -- where to store
+*           word -- what to store
+* Output:   none
+*/
+void um_store(um_T um, uint32_t id, uint32_t index, uint32_t word)
+{
+        store_word(um, id, index, word);
+}
 
-                um_instruction = segment_word(um.memory, 0, um.program_counter);
-                uint32_t op_code = um_instruction >> 28;
-                //get_opcode(um_instruction);
+/* Purpose: runs a machine for up to a budget of instructions
+* Input:    um -- the machine, with its program decoded
+*           budget -- how many instructions to run before stopping at a
+*                     Load Program, or UM_NO_BUDGET
+* Output:   UM_HALTED, UM_NEEDS_INPUT, UM_OUTPUT_FULL, UM_BUDGET_EXHAUSTED
+*           or UM_PREEMPTED
+*/
+int um_run(um_T um, uint64_t budget)
+{
+        if (um->halted) {
+                return UM_HALTED;
+        }
 
-                /* Ensures that the instruction is valid. */
-                assert(op_code < 14);
+        int status = run_um(um, budget);
 
-                if (op_code == 7) {
-                        set_three_registers(um_instruction, &um);
-                        mem_free(um.memory);
-                        return;              
-                }
+        um->halted = (status == UM_HALTED);
 
-                execute_command(&um, um_instruction, op_code);
+        /* Preempting one run doesn't preempt the next. */
+        if (status == UM_PREEMPTED) {
+                um->preempt = 0;
+        }
 
-                /* If a new program is loaded, make sure that the program 
-                 * length is changed. */
-                if (op_code == 12) {
-                        program_length = get_program_length(&um);
-                        continue;
-                }
+        return status;
+}
 
-                um.program_counter++;
-        }      
-} 
+/* Purpose: asks a machine to stop at its next Load Program
+* Input:    um -- the machine
+* Output:   none
+*/
+void um_preempt(um_T um)
+{
+        um->preempt = 1;
+}
 
+#ifdef UM_THREADED_DISPATCH
+#undef FIRST_FUSED
+#undef NUM_FUSIONS
+#endif
 #undef NUM_REGISTERS
 #undef OP_CODE_LEN
 #undef REGISTER_LEN
@@ -7,51 +7,126 @@
  *     Date:     Nov 21, 2022
  *
  *     Purpose:
- *      
- *     
+ *
+ *
  *     Interface for um.h module. Contains functions
- *     that run the UM.
+ *     that run the UM. Built into libum.a along with the modules it
+ *     uses, so other programs can embed machines: um_create() one
+ *     from a program, um_run() it for a budget of instructions at a
+ *     time, and um_destroy() it. Every machine owns all of its state,
+ *     so any number can run at once, each on one thread at a time.
  ********************************************************************/
- 
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
-#include <bitpack.h>
-#include <seq.h>
+#include <stdbool.h>
+#include <signal.h>
+#include "memory_segment.h"
+#include "io.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
 
 #ifndef UM
 #define UM
 
-typedef struct um_T um_T;
-typedef struct mem_T *mem_T;
-typedef struct seg_T *seg_T;
-
-/* Performs all the functions of the UM. */
-void run_um(Seq_T instructions); 
-
-/* Memory Segment functions */
-
-/* Creates a memory instance. */
-mem_T mem_new();
-/* Frees a memory instance. */
-void mem_free(mem_T mem_segments);
-/* Maps a memory segment. */
-uint32_t map_segment(mem_T mem_segments, uint32_t num_words);
-/* Unmaps a memory segment. */
-void unmap_segment(mem_T mem_segments, uint32_t identifier);
-/* Creates the program m[0] and stores it in memory. */
-void initalize_program(mem_T mem_segments, Seq_T instructions);
-/* Retrieves a word from memory. */
-uint32_t segmented_load(mem_T mem_segments, uint32_t id, uint32_t index);
-/* Stores a word from memory. */
-void segmented_store(mem_T mem_segments, uint32_t id, uint32_t index, 
-                     uint32_t word);
-/* Creates the program m[0] using a segment stored in memory. */
-void load_program(mem_T mem_segments, uint32_t id);
-/* Gets the length of a segment in memory. */
-uint32_t segment_length(mem_T mem_segments, uint32_t id);
-/* Gets a word from a segment in memory. */
-uint32_t segment_word(mem_T mem_segments, uint32_t id, int index);
+/* What um_run stopped for. */
+#define UM_HALTED 0
+#define UM_NEEDS_INPUT 1
+#define UM_BUDGET_EXHAUSTED 2
+#define UM_PREEMPTED 3
+#define UM_OUTPUT_FULL 4
+
+/* A budget for um_run that never runs out. */
+#define UM_NO_BUDGET UINT64_MAX
+
+typedef struct um_T *um_T;
+
+struct um_T {
+        mem_T memory;
+        uint32_t registers[8];
+        uint32_t program_counter;
+
+        /* predecoded copy of m[0], one entry per word */
+        struct inst_T *program;
+
+        /* compiler for hot blocks of m[0], or NULL when not compiling */
+        jit_T jit;
+
+        /* where to save the machine at its first Input, until it has */
+        const char *snapshot_path;
+
+        /* where every instruction is traced, when built with
+         * "make TRACE=1", or NULL */
+        trace_T trace;
+
+        /* this machine's counters, when built with "make PROFILE=1", or
+         * NULL; freed with the machine */
+        profile_T profile;
+
+        /* this machine's input and output, stdin and stdout by default */
+        io_T io;
+
+        /* told the index of each word of m[0] that a store changes */
+        void (*program_changed)(void *cl, uint32_t index);
+        void *program_changed_cl;
+
+        /* instructions executed over every um_run */
+        uint64_t instructions;
+        bool halted;
+
+        /* set by um_preempt(), cleared when the machine stops for it */
+        volatile sig_atomic_t preempt;
+};
+
+/* Creates a machine with no program, for loading one into its memory
+ * and calling um_decode(). */
+um_T um_new();
+
+/* Creates a machine ready to run the num_words words of a program. */
+um_T um_create(const uint32_t *words, uint32_t num_words);
+
+/* Frees a machine, flushing its output. */
+void um_destroy(um_T um);
+
+/* Replaces the machine's I/O devices, freeing the old ones; with
+ * io_new_host() the host supplies input spans and an output ring. */
+void um_set_io(um_T um, io_T io);
+
+/* Compiles hot blocks to native code from now on; false where that
+ * isn't supported. */
+bool um_compile(um_T um);
+
+/* Calls changed(cl, index) after each store that changes word index of
+ * m[0], so that code translated from the program ahead of time can stop
+ * trusting it; see umc.c. */
+void um_watch_program(um_T um, void changed(void *cl, uint32_t index),
+                      void *cl);
+
+/* Decodes the program in m[0]; needed once after loading into memory
+ * directly, and done by um_create(). */
+void um_decode(um_T um);
+
+/* Carries out a Segmented Store for code running the machine's program
+ * outside um_run, keeping the decoded program in step with m[0]. */
+void um_store(um_T um, uint32_t id, uint32_t index, uint32_t word);
+
+/* Runs the machine until it halts, reaches an Input with no input to be
+ * had yet or an Output with no room in the ring (see io.h), has executed
+ * budget instructions, or is preempted. The budget is checked at each
+ * Load Program, so a run can go past it by what lies between two jumps.
+ * Returns UM_HALTED, UM_NEEDS_INPUT, UM_OUTPUT_FULL, UM_BUDGET_EXHAUSTED
+ * or UM_PREEMPTED; a machine that stopped for anything but a halt
+ * carries on where it left off the next time it is run, or can be saved
+ * with snapshot_save(). */
+int um_run(um_T um, uint64_t budget);
+
+/* Asks the machine to stop at its next Load Program, where the budget is
+ * checked, with UM_PREEMPTED; safe to call from a signal handler, such
+ * as a timer's, on the thread running it. A machine that isn't running
+ * stops at the first Load Program of its next run. */
+void um_preempt(um_T um);
 
 #endif
@@ -0,0 +1,421 @@
+/********************************************************************
+ *
+ *                     um_bench.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Benchmark runner behind "make bench". Runs each program in a
+ *     benchmark list several times, each run in a child process so
+ *     that its peak RSS is its own, and checks every run's output
+ *     against the expected output. Prints one JSON object per run
+ *     and one per benchmark with the median, and flags a benchmark
+ *     whose median wall time is more than a threshold percent over
+ *     the stored baseline. A benchmark list line is
+ *
+ *         name program input expected_output
+ *
+ *     with "-" as the input for none; a baseline line is
+ *
+ *         name seconds
+ *
+ *     Usage: um_bench [--runs=N] [--threshold=PERCENT] [--jit]
+ *                     [--save] benchmarks baseline
+ *
+ *     --save writes the medians to the baseline instead of comparing.
+ *     Exits with failure if any output is wrong or any benchmark has
+ *     regressed.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "um.h"
+#include "loader.h"
+#include "io.h"
+
+#define DEFAULT_RUNS 3
+#define DEFAULT_THRESHOLD 10.0
+#define MAX_BENCHMARKS 64
+#define MAX_FIELD 256
+
+struct benchmark {
+        char name[MAX_FIELD];
+        char program[MAX_FIELD];
+        char input[MAX_FIELD];
+        char expected[MAX_FIELD];
+        double baseline;        /* seconds, or 0 for none */
+};
+
+/* one run's measurements */
+struct result {
+        double seconds;
+        uint64_t instructions;
+        long peak_rss_kb;
+        bool ok;
+};
+
+/* Purpose: reads the monotonic clock
+* Input:    none
+* Output:   the current time in seconds
+*/
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Purpose: reads the benchmark list
+* Input:    path -- the list
+*           benchmarks -- filled in, up to MAX_BENCHMARKS
+* Output:   how many were read, or -1 with the error reported on stderr
+*/
+static int read_benchmarks(const char *path, struct benchmark *benchmarks)
+{
+        FILE *list = fopen(path, "r");
+        if (list == NULL) {
+                perror(path);
+                return -1;
+        }
+
+        char line[4 * MAX_FIELD];
+        int count = 0;
+
+        while (fgets(line, sizeof(line), list) != NULL) {
+                struct benchmark *b = &benchmarks[count];
+                char extra;
+                int fields = sscanf(line, "%255s %255s %255s %255s %c",
+                                    b->name, b->program, b->input,
+                                    b->expected, &extra);
+
+                if (fields <= 0 || b->name[0] == '#') {
+                        continue;
+                }
+                if (fields != 4 || count == MAX_BENCHMARKS - 1) {
+                        fprintf(stderr, "%s: bad line: %s", path, line);
+                        fclose(list);
+                        return -1;
+                }
+
+                b->baseline = 0;
+                count++;
+        }
+
+        fclose(list);
+        return count;
+}
+
+/* Purpose: fills in each benchmark's baseline time, if it has one
+* Input:    path -- the baseline, which need not exist yet
+*           benchmarks, count -- the benchmarks
+* Output:   none
+*/
+static void read_baseline(const char *path, struct benchmark *benchmarks,
+                          int count)
+{
+        FILE *baseline = fopen(path, "r");
+        if (baseline == NULL) {
+                return;
+        }
+
+        char name[MAX_FIELD];
+        double seconds;
+
+        while (fscanf(baseline, "%255s %lf", name, &seconds) == 2) {
+                for (int i = 0; i < count; i++) {
+                        if (strcmp(benchmarks[i].name, name) == 0) {
+                                benchmarks[i].baseline = seconds;
+                        }
+                }
+        }
+
+        fclose(baseline);
+}
+
+/* Purpose: tells whether a file holds exactly what another does
+* Input:    output -- an open file, read from the start
+*           path -- the expected contents
+* Output:   true if they match
+*/
+static bool same_contents(FILE *output, const char *path)
+{
+        FILE *expected = fopen(path, "rb");
+        if (expected == NULL) {
+                perror(path);
+                return false;
+        }
+
+        rewind(output);
+
+        int a, b;
+
+        do {
+                a = getc(output);
+                b = getc(expected);
+        } while (a == b && a != EOF);
+
+        fclose(expected);
+        return a == b;
+}
+
+/* Purpose: runs a program to completion in this process, which is a
+*           child of the runner, and exits
+* Input:    b -- the benchmark
+*           output -- where its output goes
+*           report -- where to write the instruction count
+*           compile -- whether to use the jit
+* Output:   does not return
+*/
+static void run_child(const struct benchmark *b, FILE *output, int report,
+                      bool compile)
+{
+        int in_fd = open(strcmp(b->input, "-") == 0 ? "/dev/null" : b->input,
+                         O_RDONLY);
+        if (in_fd < 0) {
+                perror(b->input);
+                _exit(EXIT_FAILURE);
+        }
+
+        um_T um = um_new();
+
+        um_set_io(um, io_new(in_fd, fileno(output), OUTPUT_BUFFER_SIZE));
+        if ((compile && !um_compile(um)) ||
+            !load_program_file(um->memory, b->program)) {
+                _exit(EXIT_FAILURE);
+        }
+
+        um_decode(um);
+        um_run(um, UM_NO_BUDGET);
+
+        uint64_t instructions = um->instructions;
+
+        um_destroy(um);
+
+        if (write(report, &instructions, sizeof(instructions)) !=
+            sizeof(instructions)) {
+                _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
+}
+
+/* Purpose: runs a benchmark once and measures it
+* Input:    b -- the benchmark
+*           compile -- whether to use the jit
+* Output:   the measurements; ok is false if the run failed or its output
+*           was wrong
+*/
+static struct result run_once(const struct benchmark *b, bool compile)
+{
+        struct result result = { 0, 0, 0, false };
+        FILE *output = tmpfile();
+        int report[2];
+
+        if (output == NULL || pipe(report) != 0) {
+                perror("um_bench");
+                exit(EXIT_FAILURE);
+        }
+
+        fflush(stdout);
+
+        double start = now();
+        pid_t child = fork();
+
+        if (child < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (child == 0) {
+                close(report[0]);
+                run_child(b, output, report[1], compile);
+        }
+
+        close(report[1]);
+
+        int status;
+        struct rusage usage;
+
+        wait4(child, &status, 0, &usage);
+        result.seconds = now() - start;
+
+        bool reported = read(report[0], &result.instructions,
+                             sizeof(result.instructions)) ==
+                        sizeof(result.instructions);
+
+        close(report[0]);
+
+        result.peak_rss_kb = usage.ru_maxrss;
+        result.ok = reported && WIFEXITED(status) &&
+                    WEXITSTATUS(status) == EXIT_SUCCESS &&
+                    same_contents(output, b->expected);
+
+        fclose(output);
+        return result;
+}
+
+/* Purpose: orders run times, for qsort
+* Input:    a, b -- pointers to two times
+* Output:   negative, zero or positive as a is less, equal or greater
+*/
+static int compare_seconds(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+        static const struct option options[] = {
+                { "runs", required_argument, NULL, 'n' },
+                { "threshold", required_argument, NULL, 't' },
+                { "jit", no_argument, NULL, 'j' },
+                { "save", no_argument, NULL, 's' },
+                { NULL, 0, NULL, 0 }
+        };
+
+        int runs = DEFAULT_RUNS;
+        double threshold = DEFAULT_THRESHOLD;
+        bool compile = false;
+        bool save = false;
+        int option;
+
+        while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+                switch (option) {
+                case 'n':
+                        runs = atoi(optarg);
+                        break;
+                case 't':
+                        threshold = atof(optarg);
+                        break;
+                case 'j':
+                        compile = true;
+                        break;
+                case 's':
+                        save = true;
+                        break;
+                default:
+                        runs = 0;
+                        break;
+                }
+        }
+
+        if (runs < 1 || optind != argc - 2) {
+                fprintf(stderr, "Usage: %s [--runs=N] [--threshold=PERCENT] "
+                        "[--jit] [--save] benchmarks baseline\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        const char *baseline_path = argv[optind + 1];
+        static struct benchmark benchmarks[MAX_BENCHMARKS];
+        int count = read_benchmarks(argv[optind], benchmarks);
+
+        if (count < 0) {
+                return EXIT_FAILURE;
+        }
+        read_baseline(baseline_path, benchmarks, count);
+
+        double *seconds = malloc(runs * sizeof(*seconds));
+        assert(seconds != NULL);
+
+        bool failed = false;
+
+        for (int i = 0; i < count; i++) {
+                struct benchmark *b = &benchmarks[i];
+                uint64_t instructions = 0;
+                long peak_rss_kb = 0;
+                bool ok = true;
+
+                for (int run = 0; run < runs; run++) {
+                        struct result r = run_once(b, compile);
+
+                        printf("{\"benchmark\": \"%s\", \"run\": %d, "
+                               "\"seconds\": %.4f, \"instructions\": %llu, "
+                               "\"mips\": %.1f, \"peak_rss_kb\": %ld, "
+                               "\"output_ok\": %s}\n",
+                               b->name, run + 1, r.seconds,
+                               (unsigned long long)r.instructions,
+                               r.instructions / r.seconds / 1e6,
+                               r.peak_rss_kb, r.ok ? "true" : "false");
+
+                        seconds[run] = r.seconds;
+                        instructions = r.instructions;
+                        if (r.peak_rss_kb > peak_rss_kb) {
+                                peak_rss_kb = r.peak_rss_kb;
+                        }
+                        ok = ok && r.ok;
+                }
+
+                qsort(seconds, runs, sizeof(*seconds), compare_seconds);
+
+                double median = (runs % 2 == 1) ? seconds[runs / 2] :
+                                (seconds[runs / 2 - 1] + seconds[runs / 2]) / 2;
+                double change = (b->baseline > 0) ?
+                                (median / b->baseline - 1) * 100 : 0;
+                bool regressed = !save && b->baseline > 0 &&
+                                 change > threshold;
+
+                printf("{\"benchmark\": \"%s\", \"runs\": %d, "
+                       "\"median_seconds\": %.4f, \"instructions\": %llu, "
+                       "\"mips\": %.1f, \"peak_rss_kb\": %ld, "
+                       "\"output_ok\": %s, ",
+                       b->name, runs, median,
+                       (unsigned long long)instructions,
+                       instructions / median / 1e6, peak_rss_kb,
+                       ok ? "true" : "false");
+                if (b->baseline > 0) {
+                        printf("\"baseline_seconds\": %.4f, "
+                               "\"change_percent\": %.1f, ",
+                               b->baseline, change);
+                }
+                printf("\"regression\": %s}\n", regressed ? "true" : "false");
+
+                if (regressed) {
+                        fprintf(stderr, "%s: %.1f%% slower than the baseline "
+                                "(threshold %.1f%%)\n", b->name, change,
+                                threshold);
+                }
+                if (!ok) {
+                        fprintf(stderr, "%s: wrong output or failed run\n",
+                                b->name);
+                }
+
+                failed = failed || regressed || !ok;
+                b->baseline = median;
+        }
+
+        free(seconds);
+
+        if (save) {
+                FILE *baseline = fopen(baseline_path, "w");
+                if (baseline == NULL) {
+                        perror(baseline_path);
+                        return EXIT_FAILURE;
+                }
+                for (int i = 0; i < count; i++) {
+                        fprintf(baseline, "%s %.4f\n", benchmarks[i].name,
+                                benchmarks[i].baseline);
+                }
+                fclose(baseline);
+        }
+
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#undef DEFAULT_RUNS
+#undef DEFAULT_THRESHOLD
+#undef MAX_BENCHMARKS
+#undef MAX_FIELD
@@ -18,292 +18,604 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
-#include <sys/stat.h>
-#include <seq.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "um.h"
+#include "memory_segment.h"
+#include "loader.h"
+#include "io.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "batch.h"
+#include "profile.h"
+
+/* Purpose: reads the monotonic clock
+* Input:    none
+* Output:   the current time in seconds
+*/
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-#define HINT 100
-#define INSTRUCTION_LEN 4
+/* what SIGUSR1 reports on, and since when */
+static mem_T report_memory = NULL;
+static double report_start;
 
-#define NUM_REGISTERS 8
-#define OP_CODE_LEN 4
-#define REGISTER_LEN 3
-#define VALUE_LEN 25
-#define HINT 100
+/* Purpose: reports memory usage when the UM gets SIGUSR1; mem_report
+*           only uses write(2), so this is safe at any point in run_um
+* Input:    signal -- the signal number, unused
+* Output:   none
+*/
+static void report_on_signal(int signal)
+{
+        (void)signal;
+
+        if (report_memory != NULL) {
+                mem_report(report_memory, STDERR_FILENO,
+                           (uint64_t)((now() - report_start) * 1e3));
+        }
+}
 
+/* Purpose: prints the memory report and peak resident set size at halt
+* Input:    memory -- the UM's memory
+* Output:   none
+*/
+static void report_at_halt(mem_T memory)
+{
+        struct rusage usage;
 
-typedef struct seg_T {
-        uint32_t *segments; 
-        int seg_length;
-} *seg_T;
+        mem_report(memory, STDERR_FILENO,
+                   (uint64_t)((now() - report_start) * 1e3));
 
-typedef struct mem_T {
-        seg_T *mapped_ids;
-        uint32_t mapped_used;
-        uint32_t mapped_length;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+                fprintf(stderr, "peak RSS (KiB)%18ld\n",
+                        usage.ru_maxrss);
+        }
+}
 
-        Seq_T unmapped_ids;
-} *mem_T;
+/* glibc names the thread a timer signals only in later versions */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
 
-typedef struct um_T {
-        mem_T memory;
-        uint32_t registers[NUM_REGISTERS];
-        uint32_t program_counter;
-        unsigned ra, rb, rc;
-} um_T;
+/* the machine that this thread's timer preempts, while one is set */
+static __thread um_T timed_machine = NULL;
 
-int main(int argc, char *argv[])
+/* Purpose: preempts this thread's machine when its time is up; sent
+*           SIGALRM by the timer that run_machine sets
+* Input:    signal -- the signal number, unused
+* Output:   none
+*/
+static void preempt_on_signal(int signal)
 {
-        if (argc != 2) {
-                return EXIT_FAILURE;
+        (void)signal;
+
+        if (timed_machine != NULL) {
+                um_preempt(timed_machine);
         }
+}
 
-        FILE *fp = fopen(argv[1], "rb");
-        assert(fp != NULL);
-
-        um_T um;
-
-        um.memory = malloc(sizeof(*(um.memory)));
-        um.memory->mapped_used = 0;
-        um.memory->mapped_length = 128;
-        um.memory->mapped_ids = calloc(um.memory->mapped_length, 
-                                        sizeof(seg_T));
-        um.memory->unmapped_ids = Seq_new(HINT);
-
-        /* 
-         * confirm scan of provided program successful, then get info 
-         * Note: size of file divided by 4 since 32-bit word == 4 bytes,
-         * so this gives us total number of 32-bit words
-         */
-        struct stat program_info;
-        stat(argv[1], &program_info);
-
-        /* Note: will only read up to the last complete word in file */
-        const int total_words = program_info.st_size / 4;
-
-        seg_T program = malloc(sizeof(*program));
-        assert(program != NULL);
-        
-        uint32_t *m0 = calloc(total_words, sizeof(m0));
-        assert(m0 != NULL);
-
-        program->segments = m0;
-        program->seg_length = total_words;
-
-        um.memory->mapped_ids[0] = program;
-        (um.memory->mapped_used)++;
-
-        /* write each word in segment one byte at a time (big endian order) */
-        uint32_t *segment_zero = (um.memory->mapped_ids[0])->segments;
-        int c = fgetc(fp);
-        uint32_t um_instruction, mask;
-        
-        for (int word = 0; word < total_words; word++) {
-                
-                um_instruction = 0;
-
-                for (int i = INSTRUCTION_LEN - 1; i >= 0; i--) {
-                        mask = c;
-                        mask = mask << (i * (INSTRUCTION_LEN * 2));
-                        um_instruction = um_instruction | mask;
-                        c = fgetc(fp);
-                }
+/* How every machine in this process is set up. */
+struct settings {
+        size_t output_size;
+        uint32_t mmap_words;
+        bool compile;
+        bool profile;
+        const char *trace_path;
+
+        /* when to stop a machine that hasn't halted: after this many
+         * instructions, or seconds if timeout isn't 0 */
+        uint64_t max_instructions;
+        double timeout;
+};
+
+/* Purpose: runs a machine until it halts or reaches one of the limits
+*           in settings; both are checked at each Load Program, the
+*           timeout by a timer that signals this thread and preempts it
+* Input:    um -- the machine
+*           settings -- its limits
+* Output:   what um_run returned, or -1 with the error reported on stderr
+*           if the timer couldn't be set
+*/
+static int run_machine(um_T um, const struct settings *settings)
+{
+        if (settings->timeout == 0) {
+                return um_run(um, settings->max_instructions);
+        }
+
+        struct sigevent event;
+        timer_t timer;
 
-                segment_zero[word] = um_instruction;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = SIGALRM;
+        event.sigev_notify_thread_id = syscall(SYS_gettid);
+
+        if (timer_create(CLOCK_MONOTONIC, &event, &timer) != 0) {
+                perror("um: timer_create");
+                return -1;
         }
 
-        for (int i = 0; i < NUM_REGISTERS; i++) {
-                um.registers[i] = 0;
+        struct itimerspec when;
+
+        memset(&when, 0, sizeof(when));
+        when.it_value.tv_sec = (time_t)settings->timeout;
+        when.it_value.tv_nsec = (long)((settings->timeout -
+                                        when.it_value.tv_sec) * 1e9);
+
+        /* All zeros would disarm it instead. */
+        if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0) {
+                when.it_value.tv_nsec = 1;
         }
 
-        um.program_counter = 0;
+        timed_machine = um;
+        if (timer_settime(timer, 0, &when, NULL) != 0) {
+                perror("um: timer_settime");
+                timer_delete(timer);
+                timed_machine = NULL;
+                return -1;
+        }
 
-        uint32_t program_length = total_words;
+        int status = um_run(um, settings->max_instructions);
 
-        /* UM will keep executing commands until it reaches the end of m[0]. */
-        while (um.program_counter < program_length) {
+        /* A signal already sent is handled before this returns, while
+         * the machine is still there to preempt. */
+        timer_delete(timer);
+        timed_machine = NULL;
 
-                um_instruction = (um.memory->mapped_ids[0])->segments[um.program_counter];
-                uint32_t op_code = um_instruction >> 28;
+        return status;
+}
 
-                /* Ensures that the instruction is valid. */
-                assert(op_code < 14);
+/* Purpose: describes why a machine stopped short of halting
+* Input:    status -- what run_machine returned
+* Output:   the reason, or NULL if it halted
+*/
+static const char *stopped_for(int status)
+{
+        if (status == UM_BUDGET_EXHAUSTED) {
+                return "out of instructions";
+        } else if (status == UM_PREEMPTED) {
+                return "out of time";
+        }
+
+        return NULL;
+}
 
-                if (op_code != 13) {
-                        um.ra = um_instruction << 23 >>29;
-                        um.rb = um_instruction << 26 >> 29;
-                        um.rc = um_instruction & 0x7;
+/* Purpose: creates a machine and loads its program into it
+* Input:    settings -- how to set it up
+*           io -- its I/O devices, which it now owns
+*           program_path -- the program to load, or NULL to restore
+*           restore_path -- the snapshot to restore, if program_path is
+*                           NULL
+* Output:   the machine, or NULL with errors reported on stderr and
+*           everything, io included, freed
+*/
+static um_T start_machine(const struct settings *settings, io_T io,
+                          const char *program_path, const char *restore_path)
+{
+        um_T um = um_new();
+
+        um_set_io(um, io);
+        mem_mmap_threshold(um->memory, settings->mmap_words);
+
+        bool loaded;
+
+        if (settings->compile && !um_compile(um)) {
+                fprintf(stderr, "um: --jit isn't supported here\n");
+                loaded = false;
+        } else if (program_path != NULL) {
+                loaded = load_program_file(um->memory, program_path);
+        } else {
+                loaded = snapshot_restore(restore_path, um->memory,
+                                          um->registers, 
+                                          &um->program_counter);
+        }
+
+        if (!loaded) {
+                um_destroy(um);
+                return NULL;
+        }
+
+#ifdef UM_PROFILE
+        /* before decoding, which leaves runs unfused when profiling */
+        if (settings->profile) {
+                um->profile = profile_new(
+                                um->memory->mapped_ids[0]->seg_length);
+        }
+#endif
+
+#ifdef UM_TRACE
+        /* before decoding too, for the same reason */
+        if (settings->trace_path != NULL) {
+                um->trace = trace_open(settings->trace_path);
+                if (um->trace == NULL) {
+                        um_destroy(um);
+                        return NULL;
                 }
+        }
+#endif
 
-                if (op_code == 7) {
-                        /* Frees the array of words inside the memory segment. */
-                        for (uint32_t i = 0; i < um.memory->mapped_length; i++) {
-                                seg_T delete_segment = um.memory->mapped_ids[i];
-                                if (delete_segment != NULL) {
-                                        free(delete_segment->segments);
-                                        free(delete_segment);
-                                }
-                        }
+        um_decode(um);
+
+        return um;
+}
+
+/* Purpose: runs one line of a --batch manifest to completion or its
+*           limits; called from the batch module's worker threads
+* Input:    cl -- the settings
+*           job -- the program and its input and output files
+* Output:   true if the program ran until it halted; errors and limits
+*           reached are reported on stderr
+*/
+static bool run_job(void *cl, const struct batch_job *job)
+{
+        const struct settings *settings = cl;
+        const char *input_path = (job->input != NULL) ? job->input 
+                                                      : "/dev/null";
+
+        int in_fd = open(input_path, O_RDONLY);
+        if (in_fd < 0) {
+                fprintf(stderr, "line %u: ", job->line);
+                perror(input_path);
+                return false;
+        }
+
+        int out_fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+                fprintf(stderr, "line %u: ", job->line);
+                perror(job->output);
+                close(in_fd);
+                return false;
+        }
+
+        um_T um = start_machine(settings, 
+                                io_new(in_fd, out_fd, settings->output_size),
+                                job->program, NULL);
+
+        bool ran = false;
+
+        if (um != NULL) {
+                int status = run_machine(um, settings);
+                const char *reason = stopped_for(status);
 
-                        //Seq_free(&(mem_segments->mapped_ids));
-                        Seq_free(&(um.memory->unmapped_ids));
-                        free(um.memory);
-                        break;              
+                if (reason != NULL) {
+                        fprintf(stderr, "line %u: %s stopped after %llu "
+                                "instructions: %s\n", job->line,
+                                job->program,
+                                (unsigned long long)um->instructions,
+                                reason);
                 }
+                ran = (status == UM_HALTED);
+                um_destroy(um);
+        } else {
+                fprintf(stderr, "line %u: %s didn't load\n", job->line,
+                        job->program);
+        }
+
+        close(in_fd);
+        close(out_fd);
+
+        return ran;
+}
 
-                //execute_command(&um, um_instruction, op_code);
+/* Purpose: prints how to run the program
+* Input:    program -- the name the program was run under
+* Output:   none
+*/
+static void usage(const char *program)
+{
+        fprintf(stderr, 
+                "Usage: %s [options] program.um\n"
+                "       %s [options] --restore=FILE\n"
+                "       %s [options] --batch=MANIFEST\n"
+                "  --output-buffer=BYTES  size of the output buffer "
+                "(default %d, 0 = unbuffered)\n"
+                "  --load-time            report the time taken to load "
+                "and decode the program\n"
+                "  --profile              count instructions per opcode "
+                "and per PC (needs make PROFILE=1)\n"
+                "  --trace=FILE           log every instruction's pc, "
+                "opcode and register\n"
+                "                         write to FILE, for um_replay "
+                "(needs make TRACE=1)\n"
+                "  --jit                  compile hot blocks to native "
+                "code (x86-64 only)\n"
+                "  --snapshot-at-input=FILE\n"
+                "                         save the machine to FILE the "
+                "first time it reads input\n"
+                "  --restore=FILE         resume a saved machine instead "
+                "of loading a program\n"
+                "  --max-instructions=N   stop after about N instructions, "
+                "at the next jump\n"
+                "  --timeout=SECONDS      stop after SECONDS of wall time, "
+                "at the next jump\n"
+                "  --snapshot-at-stop=FILE\n"
+                "                         save the machine to FILE if it "
+                "stops at either limit\n"
+                "  --mmap-threshold=BYTES give segments this large or "
+                "larger their own mapping\n"
+                "                         (default %u)\n"
+                "  --memory-report        print segment usage at halt "
+                "(kill -USR1 prints it any time)\n"
+                "  --batch=MANIFEST       run every \"program input "
+                "output\" line of MANIFEST,\n"
+                "                         \"-\" for no input\n"
+                "  --threads=N            worker threads for --batch "
+                "(default: one per CPU)\n",
+                program, program, program, OUTPUT_BUFFER_SIZE,
+                MMAP_THRESHOLD_WORDS * (unsigned)sizeof(uint32_t));
+}
 
-                // switch (op_code)
-                // {
-                if (op_code == 0) { 
-                        if (um.registers[um.rc] != 0) {
-                                um.registers[um.ra] = um.registers[um.rb];
+int main(int argc, char *argv[])
+{
+        static const struct option options[] = {
+                { "output-buffer", required_argument, NULL, 'o' },
+                { "load-time", no_argument, NULL, 'l' },
+                { "profile", no_argument, NULL, 'p' },
+                { "trace", required_argument, NULL, 'T' },
+                { "jit", no_argument, NULL, 'j' },
+                { "snapshot-at-input", required_argument, NULL, 's' },
+                { "restore", required_argument, NULL, 'r' },
+                { "max-instructions", required_argument, NULL, 'i' },
+                { "timeout", required_argument, NULL, 'L' },
+                { "snapshot-at-stop", required_argument, NULL, 'S' },
+                { "mmap-threshold", required_argument, NULL, 'm' },
+                { "memory-report", no_argument, NULL, 'M' },
+                { "batch", required_argument, NULL, 'b' },
+                { "threads", required_argument, NULL, 't' },
+                { NULL, 0, NULL, 0 }
+        };
+
+        long output_size = OUTPUT_BUFFER_SIZE;
+        long long mmap_bytes = MMAP_THRESHOLD_WORDS * sizeof(uint32_t);
+        long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+        long long max_instructions = -1;
+        double timeout = 0;
+        bool report_load = false;
+        bool profile = false;
+        bool compile = false;
+        bool report_memory_at_halt = false;
+        const char *snapshot_path = NULL;
+        const char *stop_snapshot_path = NULL;
+        const char *trace_path = NULL;
+        const char *restore_path = NULL;
+        const char *batch_path = NULL;
+        int option;
+
+        while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+                char *end;
+
+                switch (option) {
+                case 'o':
+                        output_size = strtol(optarg, &end, 10);
+                        if (*end != '\0' || output_size < 0) {
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
                         }
-                } else if (op_code == 1) { 
-                        um.registers[um.ra] = (um.memory->mapped_ids[um.registers[um.rb]])->
-                                                                segments[um.registers[um.rc]];
-                } else if (op_code == 2){
-                        // segmented_store(um.memory, um.registers[um.ra], 
-                        // um.registers[um.rb], um.registers[um.rc]);
-                        (um.memory->mapped_ids[um.registers[um.ra]])->segments[um.registers[um.rb]] = um.registers[um.rc];
-                } else if (op_code == 3) { 
-                        um.registers[um.ra] = um.registers[um.rb] + um.registers[um.rc]; 
-                } else if (op_code == 4) {
-                        um.registers[um.ra] = um.registers[um.rb] * um.registers[um.rc];
-                } else if (op_code == 5) {
-                        um.registers[um.ra] = um.registers[um.rb] / um.registers[um.rc];
-                } else if (op_code == 6) {
-                        um.registers[um.ra] = ~(um.registers[um.rb] & um.registers[um.rc]);
-                } else if (op_code == 8) {
-                        seg_T new_segment = malloc(sizeof(*new_segment));
-                        assert(new_segment != NULL);
-
-                        uint32_t *new_seg = calloc(um.registers[um.rc], sizeof(new_seg));
-                        assert(new_seg != NULL);
-
-                        new_segment->segments = new_seg;
-                        new_segment->seg_length = um.registers[um.rc];
-
-                        uint32_t new_id;
-                        
-                        /* Attempts to reuse an unmapped segment identifier. */
-                        if (Seq_length(um.memory->unmapped_ids) != 0) {
-                                new_id = (uint32_t)(uintptr_t)
-                                        Seq_remlo(um.memory->unmapped_ids);
-                        } else {
-                                new_id = um.memory->mapped_used;
-
-                                if ((new_id == um.memory->mapped_length) &&
-                                (um.memory->mapped_length != UINT32_MAX)) {
-                                        um.memory->mapped_length =
-                                                um.memory->mapped_length * 2;
-                                        um.memory->mapped_ids = realloc(
-                                                        um.memory->mapped_ids,
-                                                        um.memory->mapped_length * sizeof(seg_T));
-                                }
+                        break;
+                case 'l':
+                        report_load = true;
+                        break;
+                case 'p':
+                        profile = true;
+                        break;
+                case 'T':
+                        trace_path = optarg;
+                        break;
+                case 'j':
+                        compile = true;
+                        break;
+                case 's':
+                        snapshot_path = optarg;
+                        break;
+                case 'r':
+                        restore_path = optarg;
+                        break;
+                case 'i':
+                        max_instructions = strtoll(optarg, &end, 10);
+                        if (*end != '\0' || max_instructions < 0) {
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
                         }
-
-                        um.memory->mapped_ids[new_id] = new_segment;
-                        um.memory->mapped_used++;
-
-                        um.registers[um.rb] = new_id;
-                } else if (op_code == 9) {
-                        uint32_t id = um.registers[um.rc];
-                        seg_T delete_segment = um.memory->mapped_ids[id];
-
-                        free(delete_segment->segments);
-                        free(delete_segment);
-                        
-                        um.memory->mapped_ids[id] = NULL;
-                        (um.memory->mapped_used)--;
-                        
-                        Seq_addlo(um.memory->unmapped_ids, (void *)(uintptr_t)id);
-                } else if (op_code == 10) { 
-                        putchar(um.registers[um.rc]);
-                } else if (op_code == 11) {
-                        um.registers[um.rc] = getchar();
-                } else if (op_code == 12){ 
-                        uint32_t id = um.registers[um.rb];
-                         if (id != 0) {
-                                seg_T segment = um.memory->mapped_ids[id];
-                                
-                                seg_T delete_segment = um.memory->mapped_ids[0];
-
-                                free(delete_segment->segments);
-                                free(delete_segment);
-                                
-                                um.memory->mapped_ids[0] = NULL;
-                                (um.memory->mapped_used)--;
-                                
-                                Seq_addlo(um.memory->unmapped_ids, (void *)(uintptr_t)0);
-
-                                seg_T new_segment = malloc(sizeof(*new_segment));
-                                assert(new_segment != NULL);
-
-                                uint32_t *new_seg = calloc(segment->seg_length, sizeof(new_seg));
-                                assert(new_seg != NULL);
-
-                                new_segment->segments = new_seg;
-                                new_segment->seg_length = segment->seg_length;
-
-                                uint32_t new_id;
-                                
-                                /* Attempts to reuse an unmapped segment identifier. */
-                                if (Seq_length(um.memory->unmapped_ids) != 0) {
-                                        new_id = (uint32_t)(uintptr_t)
-                                                Seq_remlo(um.memory->unmapped_ids);
-                                } else {
-                                        new_id = um.memory->mapped_used;
-
-                                        if ((new_id == um.memory->mapped_length) &&
-                                        (um.memory->mapped_length != UINT32_MAX)) {
-                                                um.memory->mapped_length =
-                                                        um.memory->mapped_length * 2;
-                                                um.memory->mapped_ids = realloc(
-                                                                um.memory->mapped_ids,
-                                                                um.memory->mapped_length * sizeof(seg_T));
-                                        }
-                                }
-
-                                um.memory->mapped_ids[new_id] = new_segment;
-                                um.memory->mapped_used++;
-
-                                // end of map seg        
-                                
-                                seg_T new_m0 = um.memory->mapped_ids[new_id];
-                                // seg_T new_m0 = Seq_get(mem_segments->mapped_ids, new_id);
-
-                                /* Copy the instructions from segment into the new program. */
-                                for (int i = 0; i < segment->seg_length; i++) {
-                                        new_m0->segments[i] = segment->segments[i];
-                                }
+                        break;
+                case 'L':
+                        timeout = strtod(optarg, &end);
+                        if (*end != '\0' || !(timeout > 0 && timeout < 1e9)) {
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
                         }
-                        um.program_counter = um.registers[um.rc];
-                } else if (op_code == 13){
-                        um.ra = um_instruction << OP_CODE_LEN >> 29;
-                        um.registers[um.ra] = um_instruction << 7 >> 7;
+                        break;
+                case 'S':
+                        stop_snapshot_path = optarg;
+                        break;
+                case 'M':
+                        report_memory_at_halt = true;
+                        break;
+                case 'm':
+                        mmap_bytes = strtoll(optarg, &end, 10);
+                        if (*end != '\0' || mmap_bytes < 0 ||
+                            mmap_bytes / sizeof(uint32_t) > UINT32_MAX) {
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                case 'b':
+                        batch_path = optarg;
+                        break;
+                case 't':
+                        num_threads = strtol(optarg, &end, 10);
+                        if (*end != '\0' || num_threads < 1) {
+                                usage(argv[0]);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+                default:
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
                 }
+        }
 
-                /* If a new program is loaded, make sure that the program 
-                 * length is changed. */
-                if (op_code == 12) {
-                        segment_zero = (um.memory->mapped_ids[0])->segments;
-                        program_length = um.memory->mapped_ids[0]->seg_length;
-                        continue;
+        /* A restored machine brings its own program, a batch its own. */
+        if (optind != argc - (restore_path == NULL && batch_path == NULL)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+#ifndef UM_PROFILE
+        if (profile) {
+                fprintf(stderr, "%s: built without profiling support; "
+                        "rebuild with make PROFILE=1\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+#endif
+
+#ifndef UM_TRACE
+        if (trace_path != NULL) {
+                fprintf(stderr, "%s: built without tracing support; "
+                        "rebuild with make TRACE=1\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+#endif
+
+        /* Compiled code skips the per-instruction counters and the trace. */
+        if (compile && (profile || trace_path != NULL)) {
+                fprintf(stderr, "%s: --jit can't be used with --profile "
+                        "or --trace\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* A trace starts from a new machine, with its registers all 0. */
+        if (trace_path != NULL && restore_path != NULL) {
+                fprintf(stderr, "%s: --trace can't be used with "
+                        "--restore\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        /* The profile, trace, snapshot and reports are one per process. */
+        if (batch_path != NULL && (profile || trace_path != NULL ||
+                                   snapshot_path != NULL ||
+                                   stop_snapshot_path != NULL ||
+                                   restore_path != NULL || report_load ||
+                                   report_memory_at_halt)) {
+                fprintf(stderr, "%s: --batch only combines with "
+                        "--output-buffer, --jit, --mmap-threshold, "
+                        "--max-instructions, --timeout and --threads\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        struct settings settings = {
+                .output_size = output_size,
+                .mmap_words = mmap_bytes / sizeof(uint32_t),
+                .compile = compile,
+                .profile = profile,
+                .trace_path = trace_path,
+                .max_instructions = (max_instructions < 0)
+                                    ? UM_NO_BUDGET
+                                    : (uint64_t)max_instructions,
+                .timeout = timeout
+        };
+
+        struct sigaction action;
+
+        /* Each thread's timer signals that thread, batch workers too. */
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = preempt_on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGALRM, &action, NULL);
+
+        if (batch_path != NULL) {
+                long failed = batch_run(batch_path, num_threads, run_job,
+                                        &settings);
+
+                return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        double load_start = now();
+        um_T um = start_machine(&settings, 
+                                io_new(STDIN_FILENO, STDOUT_FILENO, 
+                                       output_size),
+                                (restore_path == NULL) ? argv[optind] : NULL,
+                                restore_path);
+
+        if (um == NULL) {
+                return EXIT_FAILURE;
+        }
+
+        um->snapshot_path = snapshot_path;
+
+        if (report_load) {
+                fprintf(stderr, "load: %u words in %.3f ms\n",
+                        um->memory->mapped_ids[0]->seg_length,
+                        (now() - load_start) * 1e3);
+        }
+
+        report_start = load_start;
+        report_memory = um->memory;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = report_on_signal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+
+        int status = run_machine(um, &settings);
+        const char *reason = stopped_for(status);
+        bool ran = (status == UM_HALTED);
+
+        output_flush(um->io);
+
+        /* Stopped at a Load Program with its state intact, to be saved
+         * and carried on with --restore. */
+        if (reason != NULL) {
+                fprintf(stderr, "%s: stopped after %llu instructions: %s\n",
+                        argv[0], (unsigned long long)um->instructions,
+                        reason);
+
+                if (stop_snapshot_path != NULL &&
+                    snapshot_save(stop_snapshot_path, um->memory,
+                                  um->registers, um->program_counter)) {
+                        fprintf(stderr, "snapshot saved to %s\n",
+                                stop_snapshot_path);
                 }
+        }
 
-                um.program_counter++;
+        if (report_memory_at_halt) {
+                report_at_halt(um->memory);
         }
 
-        fclose(fp);
+#ifdef UM_PROFILE
+        if (profile) {
+                seg_T m0 = um->memory->mapped_ids[0];
+                profile_report(um->profile, stderr, m0->segments,
+                               m0->seg_length);
+        }
+#endif
 
-        return EXIT_SUCCESS; 
-}
+        bool traced = true;
 
-#undef NUM_REGISTERS
-#undef OP_CODE_LEN
-#undef REGISTER_LEN
-#undef VALUE_LEN 
+        if (um->trace != NULL) {
+                traced = trace_close(um->trace);
+                um->trace = NULL;
+        }
 
+        /* no more reports once memory is gone */
+        signal(SIGUSR1, SIG_IGN);
+        report_memory = NULL;
 
-#undef HINT
-#undef INSTRUCTION_LEN
\ No newline at end of file
+        um_destroy(um);
+
+        return (ran && traced) ? EXIT_SUCCESS : EXIT_FAILURE; 
+}
@@ -0,0 +1,982 @@
+/********************************************************************
+ *
+ *                     um_fuzz.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Differential tester behind "make fuzz". Generates random UM
+ *     programs that are valid by construction and runs each on every
+ *     engine libum has, the run loop this build was made with and
+ *     the jit, against the spec module; "make fuzz" builds it once
+ *     for each run loop. An engine runs a random budget at a time
+ *     with um_run; at each stop the spec is stepped to the same
+ *     instruction count and the two are compared: registers, pc,
+ *     every segment, the output so far, and that a stop for budget or
+ *     preemption came just after a Load Program.
+ *
+ *     A program is a run of blocks, each a loop of random operations
+ *     or a single one, over data registers r0-r3 with r4-r6 for
+ *     scratch and r7 counting loops. The operations cover the
+ *     arithmetic at its edges (overflow, nand, division by values
+ *     made odd so they aren't 0), conditional moves, loads and stores
+ *     through segments whose identifiers live in m[0], unmapping and
+ *     remapping those, segments mapped and unmapped in passing, some
+ *     of them thousands of words long, stores into m[0] as data and
+ *     over its own code, I/O, and copying m[0] into a new segment and
+ *     Load Program-ing it. The words after the code hold those
+ *     identifiers and scratch data. Half the programs lower the
+ *     engine's mmap threshold, so that most of its segments get
+ *     mappings of their own to be checked against the spec's on the
+ *     heap, and half start handing out identifiers just short of
+ *     MAX_FLAT_IDS, so that theirs cross into the paged table.
+ *
+ *     Usage: um_fuzz [--seed=N] [--programs=N]
+ *
+ *     Program i uses seed N + i. Each program runs in a child process,
+ *     so that an engine that crashes is caught too. A program that
+ *     shows a difference is written to fuzz-SEED.um, to run with um
+ *     or trace with um --trace, and reported with its first identifier
+ *     and mmap threshold, which the file doesn't hold; um_fuzz
+ *     --seed=SEED --programs=1 runs it again with both. Exits with
+ *     failure if any program differs.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "um.h"
+#include "memory_segment.h"
+#include "io.h"
+#include "spec.h"
+
+#define DEFAULT_PROGRAMS 200
+#define MAX_PROGRAM 65536
+#define MAX_INPUT 64
+#define RING_SIZE 64
+
+/* m[0] after the code: a segment identifier per slot, then scratch */
+#define NUM_SLOTS 4
+#define NUM_SCRATCH 8
+#define DATA_WORDS (NUM_SLOTS + NUM_SCRATCH)
+
+/* Slots below BIG_SLOTS are big enough to index with a loop count. */
+#define BIG_SLOTS 2
+#define BIG_SLOT_SIZE 64
+#define MAX_LOOP 40
+
+/* A segment mapped in passing may be big, up to BIG_MAP words. */
+#define BIG_MAP 4096
+
+/* Half the programs give segments this long or longer mappings of
+ * their own, and half hand out identifiers from up to FIRST_IDS short
+ * of the paged ones. */
+#define MAX_MMAP_WORDS (2 * BIG_SLOT_SIZE)
+#define FIRST_IDS 8
+
+#define MAX_BLOCKS 24
+#define MAX_BODY 16
+#define MAX_BUDGET 2000
+
+/* registers: r0 to r3 hold data, r4 to r6 are scratch, r7 counts */
+#define DATA 4
+#define S4 4
+#define S5 5
+#define S6 6
+#define COUNTER 7
+
+#define NUM_ENGINES 2
+
+static const char *const engine_names[NUM_ENGINES] = { "interpreter", "jit" };
+
+struct program {
+        uint64_t rng;
+        uint32_t words[MAX_PROGRAM];
+        uint32_t length;
+
+        /* words that are Load Values of an offset past the code, to have
+         * the code's length added once it is known */
+        uint32_t fixups[MAX_PROGRAM];
+        uint32_t num_fixups;
+
+        uint32_t slot_sizes[NUM_SLOTS];
+        unsigned char input[MAX_INPUT];
+        size_t input_length;
+
+        /* the length from which the engine's segments get mappings of
+         * their own, and the first identifier map_segment hands out */
+        uint32_t mmap_words;
+        uint32_t first_id;
+};
+
+/* an engine's input and output, through io_new_host */
+struct host {
+        const unsigned char *input;
+        size_t input_length;
+        bool given;
+
+        unsigned char *output;
+        size_t output_length;
+        size_t output_capacity;
+
+        struct io_ring ring;
+        unsigned char ring_bytes[RING_SIZE];
+};
+
+/* the spec module's copy of the machine */
+struct reference {
+        mem_T memory;
+        uint32_t first_id;
+        uint32_t registers[8];
+        uint32_t pc;
+        uint64_t count;
+        unsigned last_op_code;
+        bool stopped;
+
+        const unsigned char *input;
+        size_t input_length;
+        size_t input_used;
+
+        unsigned char *output;
+        size_t output_length;
+        size_t output_capacity;
+};
+
+/* Purpose: draws the next random number
+* Input:    rng -- the generator's state, not 0
+* Output:   64 random bits
+*/
+static uint64_t next(uint64_t *rng)
+{
+        /* xorshift64* */
+        *rng ^= *rng >> 12;
+        *rng ^= *rng << 25;
+        *rng ^= *rng >> 27;
+
+        return *rng * 0x2545F4914F6CDD1DULL;
+}
+
+/* Purpose: draws a random number below a bound
+* Input:    rng -- the generator's state
+*           bound -- the bound, above 0
+* Output:   a number in [0, bound)
+*/
+static uint32_t below(uint64_t *rng, uint32_t bound)
+{
+        return (next(rng) >> 32) % bound;
+}
+
+/* Purpose: appends a word to the program
+* Input:    p -- the program
+*           word -- the word
+* Output:   its index in m[0]
+*/
+static uint32_t emit(struct program *p, uint32_t word)
+{
+        assert(p->length < MAX_PROGRAM - DATA_WORDS);
+        p->words[p->length] = word;
+
+        return p->length++;
+}
+
+/* Purpose: appends a three-register instruction
+* Input:    p -- the program
+*           op_code, a, b, c -- the instruction
+* Output:   its index in m[0]
+*/
+static uint32_t op(struct program *p, unsigned op_code, unsigned a,
+                   unsigned b, unsigned c)
+{
+        return emit(p, (uint32_t)op_code << 28 | a << 6 | b << 3 | c);
+}
+
+/* Purpose: appends a Load Value
+* Input:    p -- the program
+*           a -- the register
+*           value -- the value, below 2^25
+* Output:   its index in m[0], for patch()
+*/
+static uint32_t load_value(struct program *p, unsigned a, uint32_t value)
+{
+        assert(value < (1u << 25));
+
+        return emit(p, (uint32_t)13 << 28 | a << 25 | value);
+}
+
+/* Purpose: changes the value of an earlier Load Value
+* Input:    p -- the program
+*           at -- the Load Value's index
+*           value -- the new value
+* Output:   none
+*/
+static void patch(struct program *p, uint32_t at, uint32_t value)
+{
+        assert(value < (1u << 25));
+        p->words[at] = (p->words[at] & ~0x1FFFFFFu) | value;
+}
+
+/* Purpose: appends a Load Value of the index of a word past the code
+* Input:    p -- the program
+*           a -- the register
+*           offset -- which word past the code
+* Output:   none
+*/
+static void load_data_address(struct program *p, unsigned a, uint32_t offset)
+{
+        p->fixups[p->num_fixups++] = load_value(p, a, offset);
+}
+
+/* Purpose: picks a value worth loading: one at an edge, or any
+* Input:    p -- the program
+* Output:   the value, below 2^25
+*/
+static uint32_t interesting_value(struct program *p)
+{
+        static const uint32_t edges[] = {
+                0, 1, 2, 3, 7, 255, 0xFFFF, 0x10000, 0x1FFFFFF, 0x1000000
+        };
+        unsigned n = sizeof(edges) / sizeof(edges[0]);
+        uint32_t i = below(&p->rng, 2 * n);
+
+        return (i < n) ? edges[i] : below(&p->rng, 1u << 25);
+}
+
+/* Purpose: appends code leaving in S6 the identifier in a slot, and 0
+*           in S4 and the slot's index in m[0] in S5
+* Input:    p -- the program
+*           slot -- the slot
+* Output:   none
+*/
+static void load_slot(struct program *p, unsigned slot)
+{
+        load_value(p, S4, 0);
+        load_data_address(p, S5, slot);
+        op(p, 1, S6, S4, S5);
+}
+
+/* Purpose: appends code leaving in a register an index into a slot's
+*           segment; in a loop, big slots may be indexed by the count
+* Input:    p -- the program
+*           slot -- the slot
+*           in_loop -- whether COUNTER is counting down a loop
+* Output:   the register: S5 or COUNTER
+*/
+static unsigned slot_index(struct program *p, unsigned slot, bool in_loop)
+{
+        if (in_loop && slot < BIG_SLOTS && below(&p->rng, 2) == 0) {
+                return COUNTER;
+        }
+
+        load_value(p, S5, below(&p->rng, p->slot_sizes[slot]));
+        return S5;
+}
+
+/* Purpose: appends one random operation on the data registers
+* Input:    p -- the program
+*           in_loop -- whether COUNTER is counting down a loop, so that
+*                      it can't be written
+* Output:   none
+*/
+static void random_operation(struct program *p, bool in_loop)
+{
+        unsigned x = below(&p->rng, DATA);
+        unsigned y = below(&p->rng, DATA);
+        unsigned z = below(&p->rng, DATA);
+        unsigned slot = below(&p->rng, NUM_SLOTS);
+
+        switch (below(&p->rng, 16)) {
+        case 0:
+        case 1:
+                load_value(p, x, interesting_value(p));
+                break;
+        case 2:
+                op(p, 3, x, y, z);                   /* add */
+                break;
+        case 3:
+                op(p, 4, x, y, z);                   /* multiply */
+                break;
+        case 4:
+                op(p, 6, x, y, z);                   /* nand */
+                break;
+        case 5:
+                /* divide by z | 1 */
+                load_value(p, S5, 1);
+                op(p, 6, S6, z, z);
+                op(p, 6, S5, S5, S5);
+                op(p, 6, S5, S6, S5);
+                op(p, 5, x, y, S5);
+                break;
+        case 6:
+                op(p, 0, x, y, z);                   /* conditional move */
+                break;
+        case 7:
+                load_slot(p, slot);
+                op(p, 1, x, S6, slot_index(p, slot, in_loop));
+                break;
+        case 8:
+                load_slot(p, slot);
+                op(p, 2, S6, slot_index(p, slot, in_loop), y);
+                break;
+        case 9:
+                /* unmap a slot's segment and map it a new one */
+                load_slot(p, slot);
+                op(p, 9, 0, 0, S6);
+                load_value(p, S6, p->slot_sizes[slot]);
+                op(p, 8, 0, S6, S6);
+                op(p, 2, S4, S5, S6);
+                break;
+        case 10: {
+                /* map a segment, read and write it, and unmap it */
+                uint32_t size = below(&p->rng,
+                                      below(&p->rng, 4) == 0 ? BIG_MAP : 20);
+
+                load_value(p, S6, size);
+                op(p, 8, 0, S5, S6);
+                if (size > 0) {
+                        load_value(p, S6, below(&p->rng, size));
+                        op(p, 1, x, S5, S6);         /* always 0 */
+                        op(p, 2, S5, S6, y);
+                }
+                op(p, 9, 0, 0, S5);
+                break;
+        }
+        case 11:
+                /* output x & 255 */
+                load_value(p, S5, 255);
+                op(p, 6, S6, x, S5);
+                op(p, 6, S6, S6, S6);
+                op(p, 10, 0, 0, S6);
+                break;
+        case 12:
+                if (below(&p->rng, 4) == 0) {
+                        op(p, 11, 0, 0, x);          /* input */
+                }
+                break;
+        case 13:
+                /* store into m[0] as data, and load it back */
+                load_value(p, S4, 0);
+                load_data_address(p, S5, NUM_SLOTS + below(&p->rng, 6));
+                op(p, 2, S4, S5, y);
+                op(p, 1, x, S4, S5);
+                break;
+        case 14: {
+                /* rewrite the next Load Value to load y & 0xFFFF, or
+                 * one before, which a loop runs next time round after
+                 * it has been compiled */
+                uint32_t word = (uint32_t)13 << 28 | x << 25 |
+                                (below(&p->rng, 1u << 25) & ~0xFFFFu);
+                bool earlier = (below(&p->rng, 2) == 0);
+                uint32_t at = earlier ? load_value(p, x, 0) : 0;
+
+                load_value(p, S4, word >> 16);
+                load_value(p, S5, 0x10000);
+                op(p, 4, S4, S4, S5);
+                load_value(p, S5, 0xFFFF);
+                op(p, 6, S6, y, S5);
+                op(p, 6, S5, S6, S6);
+                op(p, 3, S4, S4, S5);
+                load_value(p, S5, earlier ? at : p->length + 3);
+                load_value(p, S6, 0);
+                op(p, 2, S6, S5, S4);
+                if (!earlier) {
+                        load_value(p, x, below(&p->rng, 1u << 25));
+                }
+                break;
+        }
+        default:
+                op(p, 3, x, x, y);
+                break;
+        }
+}
+
+/* Purpose: appends a loop running a random body a random number of
+*           times, counting down in COUNTER
+* Input:    p -- the program
+* Output:   none
+*/
+static void random_loop(struct program *p)
+{
+        unsigned body = 1 + below(&p->rng, MAX_BODY);
+
+        load_value(p, COUNTER, 1 + below(&p->rng, MAX_LOOP));
+        uint32_t top = p->length;
+
+        for (unsigned i = 0; i < body; i++) {
+                random_operation(p, true);
+        }
+
+        /* COUNTER += ~0; jump to top unless it is 0 */
+        load_value(p, S5, 0);
+        op(p, 6, S5, S5, S5);
+        op(p, 3, COUNTER, COUNTER, S5);
+        uint32_t exit = load_value(p, S5, 0);
+        load_value(p, S6, top);
+        op(p, 0, S5, S6, COUNTER);
+        load_value(p, S6, 0);
+        op(p, 12, 0, S6, S5);
+
+        patch(p, exit, p->length);
+}
+
+/* Purpose: appends code that copies m[0] into a new segment and loads
+*           that as the program, carrying on after the Load Program
+* Input:    p -- the program
+* Output:   none
+*/
+static void copy_program(struct program *p)
+{
+        /* r0 and r1 are needed for the loop's jump */
+        load_value(p, S4, 0);
+        load_data_address(p, S5, NUM_SLOTS + 6);
+        op(p, 2, S4, S5, 0);
+        load_data_address(p, S5, NUM_SLOTS + 7);
+        op(p, 2, S4, S5, 1);
+
+        /* the length of m[0] */
+        load_data_address(p, COUNTER, DATA_WORDS);
+        op(p, 8, 0, S6, COUNTER);
+
+        uint32_t top = p->length;
+
+        load_value(p, S5, 0);
+        op(p, 6, S5, S5, S5);
+        op(p, 3, COUNTER, COUNTER, S5);
+        op(p, 1, S5, S4, COUNTER);
+        op(p, 2, S6, COUNTER, S5);
+        uint32_t exit = load_value(p, 0, 0);
+        load_value(p, 1, top);
+        op(p, 0, 0, 1, COUNTER);
+        op(p, 12, 0, S4, 0);
+
+        patch(p, exit, p->length);
+        uint32_t after = load_value(p, S5, 0);
+        op(p, 12, 0, S6, S5);
+        patch(p, after, p->length);
+
+        load_data_address(p, S5, NUM_SLOTS + 6);
+        op(p, 1, 0, S4, S5);
+        load_data_address(p, S5, NUM_SLOTS + 7);
+        op(p, 1, 1, S4, S5);
+
+        /* The copy stays m[0] either way; unmapping it leaves m[0]
+         * unshared. */
+        if (below(&p->rng, 2) == 0) {
+                op(p, 9, 0, 0, S6);
+        }
+}
+
+/* Purpose: generates a random program
+* Input:    p -- filled in
+*           seed -- which program
+* Output:   none
+*/
+static void generate(struct program *p, uint64_t seed)
+{
+        memset(p, 0, sizeof(*p));
+        p->rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+        p->mmap_words = (below(&p->rng, 2) == 0)
+                        ? 1 + below(&p->rng, MAX_MMAP_WORDS)
+                        : MMAP_THRESHOLD_WORDS;
+        p->first_id = (below(&p->rng, 2) == 0)
+                      ? MAX_FLAT_IDS - below(&p->rng, FIRST_IDS)
+                      : 1;
+
+        for (unsigned slot = 0; slot < NUM_SLOTS; slot++) {
+                p->slot_sizes[slot] = (slot < BIG_SLOTS) ? BIG_SLOT_SIZE
+                                                         : 1 + below(&p->rng, 8);
+
+                load_value(p, S6, p->slot_sizes[slot]);
+                op(p, 8, 0, S6, S6);
+                load_value(p, S4, 0);
+                load_data_address(p, S5, slot);
+                op(p, 2, S4, S5, S6);
+        }
+
+        unsigned blocks = 1 + below(&p->rng, MAX_BLOCKS);
+
+        for (unsigned i = 0; i < blocks; i++) {
+                unsigned kind = below(&p->rng, 8);
+
+                if (kind == 0) {
+                        copy_program(p);
+                } else if (kind < 4) {
+                        random_operation(p, false);
+                } else {
+                        random_loop(p);
+                }
+        }
+
+        for (unsigned r = 0; r < DATA; r++) {
+                load_value(p, S5, 255);
+                op(p, 6, S6, r, S5);
+                op(p, 6, S6, S6, S6);
+                op(p, 10, 0, 0, S6);
+        }
+        op(p, 7, 0, 0, 0);
+
+        uint32_t code_length = p->length;
+
+        for (uint32_t i = 0; i < p->num_fixups; i++) {
+                uint32_t at = p->fixups[i];
+
+                patch(p, at, code_length + (p->words[at] & 0x1FFFFFF));
+        }
+        for (unsigned i = 0; i < DATA_WORDS; i++) {
+                p->words[p->length++] = (i < NUM_SLOTS) ? 0
+                                                        : (uint32_t)next(&p->rng);
+        }
+
+        p->input_length = below(&p->rng, MAX_INPUT);
+        for (size_t i = 0; i < p->input_length; i++) {
+                p->input[i] = next(&p->rng);
+        }
+}
+
+/* Purpose: appends a byte to a growing buffer
+* Input:    bytes, length, capacity -- the buffer
+*           byte -- the byte
+* Output:   none
+*/
+static void append(unsigned char **bytes, size_t *length, size_t *capacity,
+                   unsigned char byte)
+{
+        if (*length == *capacity) {
+                *capacity = (*capacity == 0) ? 256 : 2 * *capacity;
+                *bytes = realloc(*bytes, *capacity);
+                assert(*bytes != NULL);
+        }
+        (*bytes)[(*length)++] = byte;
+}
+
+/* Purpose: hands an engine all its input as one span
+* Input:    cl -- the host
+*           bytes, length -- set to the span, or to an empty one after
+* Output:   true
+*/
+static bool fill(void *cl, const unsigned char **bytes, size_t *length)
+{
+        struct host *host = cl;
+
+        *bytes = host->input;
+        *length = host->given ? 0 : host->input_length;
+        host->given = true;
+
+        return true;
+}
+
+/* Purpose: keeps an engine's output
+* Input:    cl -- the host
+*           ring -- the output waiting
+* Output:   none
+*/
+static void drain(void *cl, struct io_ring *ring)
+{
+        struct host *host = cl;
+
+        for (; ring->tail != ring->head; ring->tail++) {
+                append(&host->output, &host->output_length,
+                       &host->output_capacity,
+                       ring->bytes[ring->tail & (ring->size - 1)]);
+        }
+}
+
+/* Purpose: steps the spec's copy of the machine to an instruction count
+* Input:    ref -- the copy
+*           count -- the count, or more than it will ever run
+* Output:   none
+*/
+static void advance(struct reference *ref, uint64_t count)
+{
+        while (ref->count < count && !ref->stopped) {
+                if (ref->pc >= segment_length(ref->memory, 0)) {
+                        ref->stopped = true;
+                        break;
+                }
+
+                unsigned op_code = segment_word(ref->memory, 0, ref->pc) >> 28;
+                uint32_t input = UINT32_MAX;
+                int output;
+
+                if (op_code == 11 && ref->input_used < ref->input_length) {
+                        input = ref->input[ref->input_used++];
+                }
+
+                ref->stopped = !spec_step(ref->memory, ref->registers,
+                                          &ref->pc, input, &output);
+                ref->count++;
+                ref->last_op_code = op_code;
+
+                if (output >= 0) {
+                        append(&ref->output, &ref->output_length,
+                               &ref->output_capacity, output);
+                }
+        }
+}
+
+/* Purpose: compares an engine's machine with the spec's copy
+* Input:    um -- the engine's machine, stopped by um_run
+*           status -- what um_run returned
+*           host -- its I/O
+*           ref -- the spec's copy, at the same count
+*           difference -- set to what differs, if anything does
+* Output:   true if they agree
+*/
+static bool agree(um_T um, int status, struct host *host,
+                  struct reference *ref, const char **difference)
+{
+        output_flush(um->io);
+
+        bool stopped = ref->stopped ||
+                       ref->pc >= segment_length(ref->memory, 0);
+
+        if (ref->count != um->instructions) {
+                *difference = "the spec stopped before that count";
+        } else if ((status == UM_HALTED) != stopped) {
+                *difference = (status == UM_HALTED) ? "halted early"
+                                                    : "didn't halt";
+        } else if ((status == UM_BUDGET_EXHAUSTED ||
+                    status == UM_PREEMPTED) && ref->last_op_code != 12) {
+                *difference = "stopped for budget after something other "
+                              "than a Load Program";
+        } else if (memcmp(um->registers, ref->registers,
+                          sizeof(ref->registers)) != 0) {
+                *difference = "registers";
+        } else if (status != UM_HALTED && um->program_counter != ref->pc) {
+                *difference = "program counter";
+        } else if (host->output_length != ref->output_length ||
+                   (ref->output_length > 0 &&
+                    memcmp(host->output, ref->output,
+                           ref->output_length) != 0)) {
+                *difference = "output";
+        } else if (um->memory->next_id != ref->memory->next_id) {
+                *difference = "identifiers handed out";
+        } else {
+                for (uint64_t id = 0; id < ref->memory->next_id;
+                     id = (id == 0) ? ref->first_id : id + 1) {
+                        seg_T mine = segment_at(um->memory, id);
+                        seg_T spec = segment_at(ref->memory, id);
+
+                        if ((mine == NULL) != (spec == NULL) ||
+                            (mine != NULL &&
+                             (mine->seg_length != spec->seg_length ||
+                              (spec->seg_length > 0 &&
+                               memcmp(mine->segments, spec->segments,
+                                      spec->seg_length *
+                                      sizeof(uint32_t)) != 0)))) {
+                                *difference = "segment contents";
+                                return false;
+                        }
+                }
+                return true;
+        }
+
+        return false;
+}
+
+/* Purpose: loads a program into a fresh memory and skips to its first
+*           identifier, as a restored snapshot would
+* Input:    memory -- the memory, with nothing mapped
+*           p -- the program
+*           mmap_words -- the memory's mmap threshold
+* Output:   none
+*/
+static void start_memory(mem_T memory, const struct program *p,
+                         uint32_t mmap_words)
+{
+        mem_mmap_threshold(memory, mmap_words);
+        initalize_program(memory, p->words, p->length);
+        if (p->first_id > 1) {
+                restore_ids(memory, p->first_id, p->words, 0);
+        }
+}
+
+/* Purpose: runs a program on one engine against the spec
+* Input:    p -- the program
+*           seed -- its seed, for the report
+*           engine -- index into engine_names
+*           checkpoints -- added to for each comparison
+* Output:   false if they differed, with the difference reported; true
+*           if they agreed or the engine isn't supported here
+*/
+static bool check_engine(const struct program *p, uint64_t seed,
+                         unsigned engine, uint64_t *checkpoints)
+{
+        struct host host;
+        struct io_callbacks callbacks = { fill, drain, &host };
+
+        memset(&host, 0, sizeof(host));
+        host.input = p->input;
+        host.input_length = p->input_length;
+        host.ring.bytes = host.ring_bytes;
+        host.ring.size = RING_SIZE;
+
+        um_T um = um_new();
+
+        um_set_io(um, io_new_host(&callbacks, &host.ring));
+        if (engine == 1 && !um_compile(um)) {
+                um_destroy(um);
+                free(host.output);
+                return true;
+        }
+        start_memory(um->memory, p, p->mmap_words);
+        um_decode(um);
+
+        struct reference ref;
+
+        memset(&ref, 0, sizeof(ref));
+        ref.memory = mem_new();
+        ref.first_id = p->first_id;
+        ref.input = p->input;
+        ref.input_length = p->input_length;
+        /* The spec's segments stay on the heap, to check the engine's
+         * own mappings against. */
+        start_memory(ref.memory, p, MMAP_THRESHOLD_WORDS);
+
+        /* the budgets come from their own generator, so that a program
+         * is the same whatever engines it is run on */
+        uint64_t budgets = (seed + 1) * (0xB5AD4ECEDA1CE2A9ULL + engine);
+
+        bool ok = true;
+        int status;
+
+        do {
+                uint64_t budget = (below(&budgets, 4) == 0)
+                                  ? 1 + below(&budgets, 8)
+                                  : 1 + below(&budgets, MAX_BUDGET);
+                bool preempted = (below(&budgets, 8) == 0);
+                const char *difference;
+
+                /* A preempted run stops at its first Load Program. */
+                if (preempted) {
+                        um_preempt(um);
+                }
+
+                status = um_run(um, budget);
+                advance(&ref, um->instructions);
+                (*checkpoints)++;
+
+                bool agreed = agree(um, status, &host, &ref, &difference);
+
+                if (agreed && preempted != (status == UM_PREEMPTED) &&
+                    status != UM_HALTED) {
+                        difference = preempted ? "ran on when preempted"
+                                               : "preempted unasked";
+                        agreed = false;
+                }
+
+                if (!agreed) {
+                        fprintf(stderr, "seed %llu: %s and the spec differ "
+                                "after %llu instructions: %s\n",
+                                (unsigned long long)seed,
+                                engine_names[engine],
+                                (unsigned long long)um->instructions,
+                                difference);
+                        ok = false;
+                }
+        } while (ok && status != UM_HALTED);
+
+        mem_free(ref.memory);
+        free(ref.output);
+        um_destroy(um);
+        free(host.output);
+
+        return ok;
+}
+
+/* Purpose: writes a program's words out as a .um file, big-endian,
+*           and reports the settings they run with
+* Input:    p -- the program
+*           seed -- its seed, which names the file
+* Output:   none; errors are reported on stderr
+*/
+static void save(const struct program *p, uint64_t seed)
+{
+        char path[64];
+
+        snprintf(path, sizeof(path), "fuzz-%llu.um",
+                 (unsigned long long)seed);
+
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+                perror(path);
+                return;
+        }
+
+        for (uint32_t i = 0; i < p->length; i++) {
+                uint32_t word = p->words[i];
+
+                for (int shift = 24; shift >= 0; shift -= 8) {
+                        putc(word >> shift, file);
+                }
+        }
+
+        if (fclose(file) != 0) {
+                perror(path);
+        } else {
+                fprintf(stderr, "seed %llu: written to %s\n",
+                        (unsigned long long)seed, path);
+        }
+
+        /* A plain um run hands out identifiers from 1 with the default
+         * threshold; only um_fuzz runs the program as it failed. */
+        fprintf(stderr, "seed %llu: identifiers from %u, mmap threshold "
+                "%u words; rerun with um_fuzz --seed=%llu --programs=1\n",
+                (unsigned long long)seed, p->first_id, p->mmap_words,
+                (unsigned long long)seed);
+}
+
+/* Purpose: runs a program on every engine in a child process
+* Input:    p -- the program
+*           seed -- its seed
+*           checkpoints -- added to for each comparison
+* Output:   true if every engine agreed with the spec; a crash is
+*           reported on stderr
+*/
+static bool check_program(const struct program *p, uint64_t seed,
+                          uint64_t *checkpoints)
+{
+        int report[2];
+
+        fflush(stdout);
+        if (pipe(report) != 0) {
+                perror("um_fuzz");
+                exit(EXIT_FAILURE);
+        }
+
+        pid_t child = fork();
+
+        if (child < 0) {
+                perror("fork");
+                exit(EXIT_FAILURE);
+        }
+        if (child == 0) {
+                uint64_t count = 0;
+                bool ok = true;
+
+                close(report[0]);
+                for (unsigned engine = 0; engine < NUM_ENGINES; engine++) {
+                        ok = check_engine(p, seed, engine, &count) && ok;
+                }
+                if (write(report[1], &count, sizeof(count)) !=
+                    sizeof(count)) {
+                        _exit(EXIT_FAILURE);
+                }
+                _exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        close(report[1]);
+
+        int status;
+        uint64_t count;
+
+        waitpid(child, &status, 0);
+        if (read(report[0], &count, sizeof(count)) == sizeof(count)) {
+                *checkpoints += count;
+        }
+        close(report[0]);
+
+        if (WIFSIGNALED(status)) {
+                fprintf(stderr, "seed %llu: killed by %s\n",
+                        (unsigned long long)seed,
+                        strsignal(WTERMSIG(status)));
+        }
+
+        return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+        static const struct option options[] = {
+                { "seed", required_argument, NULL, 's' },
+                { "programs", required_argument, NULL, 'n' },
+                { NULL, 0, NULL, 0 }
+        };
+
+        uint64_t first_seed = 1;
+        long programs = DEFAULT_PROGRAMS;
+        bool usage = false;
+        int option;
+
+        while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+                char *end;
+
+                switch (option) {
+                case 's':
+                        first_seed = strtoull(optarg, &end, 10);
+                        usage = usage || *end != '\0';
+                        break;
+                case 'n':
+                        programs = strtol(optarg, &end, 10);
+                        usage = usage || *end != '\0' || programs < 1;
+                        break;
+                default:
+                        usage = true;
+                        break;
+                }
+        }
+
+        if (usage || optind != argc) {
+                fprintf(stderr, "Usage: %s [--seed=N] [--programs=N]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        static struct program program;
+        uint64_t checkpoints = 0;
+        uint64_t words = 0;
+        long failed = 0;
+
+        for (long i = 0; i < programs; i++) {
+                uint64_t seed = first_seed + i;
+
+                generate(&program, seed);
+                words += program.length;
+
+                if (!check_program(&program, seed, &checkpoints)) {
+                        save(&program, seed);
+                        failed++;
+                }
+        }
+
+        printf("%ld programs (%llu words), %llu checkpoints: ", programs,
+               (unsigned long long)words, (unsigned long long)checkpoints);
+        if (failed == 0) {
+                printf("no differences\n");
+        } else {
+                printf("%ld differed\n", failed);
+        }
+
+        return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#undef DEFAULT_PROGRAMS
+#undef MAX_PROGRAM
+#undef MAX_INPUT
+#undef RING_SIZE
+#undef NUM_SLOTS
+#undef NUM_SCRATCH
+#undef DATA_WORDS
+#undef BIG_SLOTS
+#undef BIG_SLOT_SIZE
+#undef MAX_LOOP
+#undef BIG_MAP
+#undef MAX_MMAP_WORDS
+#undef FIRST_IDS
+#undef MAX_BLOCKS
+#undef MAX_BODY
+#undef MAX_BUDGET
+#undef DATA
+#undef S4
+#undef S5
+#undef S6
+#undef COUNTER
+#undef NUM_ENGINES
@@ -0,0 +1,202 @@
+/********************************************************************
+ *
+ *                     um_replay.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Checks a trace written by "um --trace" against a fresh run of
+ *     the program, and reports the first instruction at which they
+ *     differ: its pc, its opcode or the register it changed. The
+ *     fresh run is through the spec module, which shares nothing with
+ *     the run loops in um.c but the memory module, so that a change
+ *     to dispatch, fusion or the jit can be checked against it. Input
+ *     comes from the trace, which has what each Input read; output is
+ *     dropped.
+ *
+ *     Usage: um_replay program.um trace
+ *
+ *     Exits with failure if the two differ or the trace is cut short.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "memory_segment.h"
+#include "loader.h"
+#include "trace.h"
+#include "spec.h"
+
+#define NUM_REGISTERS 8
+
+static const char *const names[16] = {
+        "cmov", "sload", "sstore", "add", "mul", "div", "nand", "halt",
+        "map", "unmap", "out", "in", "loadp", "loadv", "invalid", "invalid"
+};
+
+/* Purpose: prints an instruction as a trace would have it
+* Input:    out -- where to print it
+*           label -- what it is
+*           record -- the instruction
+* Output:   none
+*/
+static void print_record(FILE *out, const char *label,
+                         const struct trace_record *record)
+{
+        fprintf(out, "  %-7s pc %u, %s", label, record->pc,
+                names[record->op_code]);
+        if (record->wrote) {
+                fprintf(out, ", r%u = %u\n", record->reg, record->value);
+        } else {
+                fprintf(out, ", no register changed\n");
+        }
+}
+
+/* Purpose: runs one instruction
+* Input:    memory -- the machine's memory
+*           r -- its registers
+*           pc -- its program counter, moved on
+*           traced -- the same instruction from the trace, for what an
+*                     Input read
+*           ran -- filled in with what the instruction did
+* Output:   false if the machine stops: it halted or failed
+*/
+static bool step(mem_T memory, uint32_t *r, uint32_t *pc,
+                 const struct trace_record *traced,
+                 struct trace_record *ran)
+{
+        uint32_t before[NUM_REGISTERS];
+        uint32_t word = segment_word(memory, 0, *pc);
+        unsigned c = word & 0x7;
+
+        memcpy(before, r, sizeof(before));
+
+        /* An Input that changed nothing read what was there already. */
+        uint32_t input = (traced->wrote && traced->reg == c) ? traced->value
+                                                             : r[c];
+        int output;
+
+        ran->pc = *pc;
+        ran->op_code = word >> 28;
+
+        bool running = spec_step(memory, r, pc, input, &output);
+
+        ran->wrote = false;
+        ran->reg = 0;
+        ran->value = 0;
+
+        for (unsigned i = 0; i < NUM_REGISTERS; i++) {
+                if (r[i] != before[i]) {
+                        ran->wrote = true;
+                        ran->reg = i;
+                        ran->value = r[i];
+                }
+        }
+
+        return running;
+}
+
+/* Purpose: tells whether a traced instruction is the one that ran
+* Input:    traced, ran -- the two
+* Output:   true if they agree
+*/
+static bool same(const struct trace_record *traced,
+                 const struct trace_record *ran)
+{
+        return traced->pc == ran->pc && traced->op_code == ran->op_code &&
+               traced->wrote == ran->wrote &&
+               (!ran->wrote || (traced->reg == ran->reg &&
+                                traced->value == ran->value));
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc != 3) {
+                fprintf(stderr, "Usage: %s program.um trace\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        mem_T memory = mem_new();
+
+        if (!load_program_file(memory, argv[1])) {
+                mem_free(memory);
+                return EXIT_FAILURE;
+        }
+
+        trace_reader_T reader = trace_reader_open(argv[2]);
+        if (reader == NULL) {
+                mem_free(memory);
+                return EXIT_FAILURE;
+        }
+
+        uint32_t r[NUM_REGISTERS] = { 0 };
+        uint32_t pc = 0;
+        uint64_t count = 0;
+        bool running = true;
+        bool broken;
+        bool ok = true;
+        struct trace_record traced, ran;
+
+        while (trace_read(reader, &traced, &broken)) {
+                if (!running || pc >= segment_length(memory, 0)) {
+                        printf("divergence at instruction %llu: the trace "
+                               "goes on after the machine stops\n",
+                               (unsigned long long)count);
+                        print_record(stdout, "trace:", &traced);
+                        ok = false;
+                        break;
+                }
+
+                /* The pc and opcode must agree before the instruction
+                 * is worth running. */
+                ran.pc = pc;
+                ran.op_code = segment_word(memory, 0, pc) >> 28;
+
+                if (traced.pc == ran.pc && traced.op_code == ran.op_code) {
+                        running = step(memory, r, &pc, &traced, &ran);
+                }
+
+                if (!same(&traced, &ran)) {
+                        printf("divergence at instruction %llu:\n",
+                               (unsigned long long)count);
+                        print_record(stdout, "trace:", &traced);
+                        if (traced.pc == ran.pc &&
+                            traced.op_code == ran.op_code) {
+                                print_record(stdout, "replay:", &ran);
+                        } else {
+                                printf("  %-7s pc %u, %s\n", "replay:",
+                                       ran.pc, names[ran.op_code]);
+                        }
+                        ok = false;
+                        break;
+                }
+
+                count++;
+        }
+
+        if (ok && broken) {
+                printf("the trace is cut short after instruction %llu\n",
+                       (unsigned long long)count);
+                ok = false;
+        }
+        if (ok) {
+                bool stopped = !running || pc >= segment_length(memory, 0);
+
+                printf("%llu instructions match%s\n",
+                       (unsigned long long)count,
+                       stopped ? "" : "; the trace ends before the machine "
+                                      "stops");
+        }
+
+        trace_reader_close(reader);
+        mem_free(memory);
+
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#undef NUM_REGISTERS
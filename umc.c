@@ -0,0 +1,373 @@
+/********************************************************************
+ *
+ *                     umc.c
+ *
+ *     Assignment: um
+ *     Authors:  Dan Patterson (dpatte04), Helina Mesfin (hmesfi01)
+ *     Date:     Nov 21, 2022
+ *
+ *     Purpose:
+ *
+ *     Ahead-of-time translator from a UM program to C. Every word of
+ *     m[0] becomes a label followed by its instruction as a line of
+ *     C, with the registers in locals, so straight-line code falls
+ *     from one label to the next and Load Program jumps through a
+ *     switch over the labels. Segments, I/O and everything else come
+ *     from libum.a, so the C builds into a standalone program:
+ *
+ *         umc program.um program.c
+ *         gcc -O2 -I. program.c libum.a -lm -lpthread
+ *
+ *     The labels are split into functions of WORDS_PER_FUNCTION words,
+ *     since gcc takes minutes over one function with a label for every
+ *     word of a program like midmark. A jump within a function goes
+ *     through that function's switch; a jump out of it returns to a
+ *     loop that calls the function holding the target.
+ *
+ *     The translation is of the program as loaded. Input, Halt and
+ *     words that aren't instructions are left to the interpreter,
+ *     which runs from there to the next Load Program and hands back
+ *     at its target. Stores into m[0] go through um_store(), which
+ *     reports each word they change; the translated code marks it
+ *     stale, along with the words before it that fall through into
+ *     it, and a jump to a stale word goes to the interpreter instead.
+ *     Once the program loads another segment into m[0], the
+ *     interpreter runs the rest of it.
+ ********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory_segment.h"
+#include "loader.h"
+
+#define WORDS_PER_FUNCTION 256
+#define WORDS_PER_LINE 6
+
+/* Everything before the program's words. */
+static const char prologue[] =
+"#include <stdlib.h>\n"
+"#include <stdint.h>\n"
+"#include <stdbool.h>\n"
+"#include \"um.h\"\n"
+"#include \"memory_segment.h\"\n"
+"#include \"io.h\"\n"
+"\n"
+"/* Leaves the instruction at a word to the interpreter. */\n"
+"#define INTERPRET(at)                                                    \\\n"
+"        do {                                                             \\\n"
+"                pc = (at);                                               \\\n"
+"                interpret = true;                                        \\\n"
+"                goto leave;                                              \\\n"
+"        } while (0)\n"
+"\n"
+"/* Jumps to a word, through this function's switch if it holds it. */\n"
+"#define JUMP(target)                                                     \\\n"
+"        do {                                                             \\\n"
+"                pc = (target);                                           \\\n"
+"                goto dispatch;                                           \\\n"
+"        } while (0)\n"
+"\n"
+"/* Move the registers between the machine and locals. */\n"
+"#define ENTER()                                                          \\\n"
+"        uint32_t r0 = um->registers[0], r1 = um->registers[1];          \\\n"
+"        uint32_t r2 = um->registers[2], r3 = um->registers[3];          \\\n"
+"        uint32_t r4 = um->registers[4], r5 = um->registers[5];          \\\n"
+"        uint32_t r6 = um->registers[6], r7 = um->registers[7];          \\\n"
+"        uint32_t pc = um->program_counter;                               \\\n"
+"        mem_T mem = um->memory;                                          \\\n"
+"        io_T io = um->io;                                                \\\n"
+"        bool interpret = false;                                          \\\n"
+"        (void)mem;                                                       \\\n"
+"        (void)io\n"
+"\n"
+"#define LEAVE()                                                          \\\n"
+"        um->registers[0] = r0; um->registers[1] = r1;                    \\\n"
+"        um->registers[2] = r2; um->registers[3] = r3;                    \\\n"
+"        um->registers[4] = r4; um->registers[5] = r5;                    \\\n"
+"        um->registers[6] = r6; um->registers[7] = r7;                    \\\n"
+"        um->program_counter = pc;                                        \\\n"
+"        return interpret\n"
+"\n"
+"/* Segmented Store into m[0], which keeps the interpreter in step; if\n"
+" * it changed the words that follow, the interpreter runs them. */\n"
+"#define STORE_M0(at, index, word)                                        \\\n"
+"        do {                                                             \\\n"
+"                um_store(um, 0, (index), (word));                        \\\n"
+"                if (stale[(at) + 1]) {                                   \\\n"
+"                        INTERPRET((at) + 1);                             \\\n"
+"                }                                                        \\\n"
+"        } while (0)\n"
+"\n"
+"/* Segmented Store into any segment but m[0]. */\n"
+"static inline void store(mem_T mem, uint32_t id, uint32_t index,\n"
+"                         uint32_t word)\n"
+"{\n"
+"        seg_T segment = segment_at(mem, id);\n"
+"\n"
+"        if (segment->refs > 1) {\n"
+"                segment = unshare_segment(mem, id);\n"
+"        }\n"
+"        segment->segments[index] = word;\n"
+"}\n"
+"\n";
+
+/* Between the words and the first function. */
+static const char stale_marks[] =
+"/* words whose translation no longer matches m[0] */\n"
+"static bool stale[NUM_WORDS + 1];\n"
+"\n"
+"/* Whether straight-line code stops at a word rather than falling\n"
+" * through: Load Program jumps, and the interpreter takes the rest. */\n"
+"static inline bool ends_run(uint32_t word)\n"
+"{\n"
+"        unsigned op_code = word >> 28;\n"
+"\n"
+"        return op_code == 7 || op_code == 11 || op_code == 12 ||\n"
+"               op_code >= 14;\n"
+"}\n"
+"\n"
+"/* Marks a word of m[0] stale, and the words that fall through into it,\n"
+" * unless the store put back what was translated. */\n"
+"static void program_changed(void *cl, uint32_t index)\n"
+"{\n"
+"        um_T um = cl;\n"
+"\n"
+"        if (index >= NUM_WORDS ||\n"
+"            segment_at(um->memory, 0)->segments[index] == words[index]) {\n"
+"                return;\n"
+"        }\n"
+"\n"
+"        stale[index] = true;\n"
+"        while (index > 0 && !stale[index - 1] &&\n"
+"               !ends_run(words[index - 1])) {\n"
+"                stale[--index] = true;\n"
+"        }\n"
+"}\n"
+"\n";
+
+/* After the last function. */
+static const char epilogue[] =
+"/* Runs the program until the interpreter has to take over for good.\n"
+" * Each function returns true when it stops at an instruction for the\n"
+" * interpreter, and false when it jumps out of its words. */\n"
+"static void run(um_T um)\n"
+"{\n"
+"        seg_T program = segment_at(um->memory, 0);\n"
+"\n"
+"        um_watch_program(um, program_changed, um);\n"
+"\n"
+"        for (;;) {\n"
+"                uint32_t pc = um->program_counter;\n"
+"\n"
+"                if (pc < NUM_WORDS && !stale[pc] &&\n"
+"                    !functions[pc / WORDS_PER_FUNCTION](um)) {\n"
+"                        continue;\n"
+"                }\n"
+"\n"
+"                /* A budget of one runs up to and including a Load\n"
+"                 * Program. */\n"
+"                if (um_run(um, 1) != UM_BUDGET_EXHAUSTED ||\n"
+"                    segment_at(um->memory, 0) != program) {\n"
+"                        break;\n"
+"                }\n"
+"        }\n"
+"\n"
+"        um_watch_program(um, NULL, NULL);\n"
+"}\n"
+"\n"
+"int main()\n"
+"{\n"
+"        um_T um = um_create(words, NUM_WORDS);\n"
+"\n"
+"        run(um);\n"
+"        um_run(um, UM_NO_BUDGET);\n"
+"        um_destroy(um);\n"
+"\n"
+"        return EXIT_SUCCESS;\n"
+"}\n";
+
+/* Purpose: writes one word of m[0] as a labelled line of C
+* Input:    out -- the C file
+*           pc -- the word's index
+*           word -- the word
+* Output:   none
+*/
+static void emit_word(FILE *out, uint32_t pc, uint32_t word)
+{
+        unsigned op_code = word >> 28;
+        unsigned a = (word >> 6) & 0x7;
+        unsigned b = (word >> 3) & 0x7;
+        unsigned c = word & 0x7;
+
+        fprintf(out, "L%u: ", pc);
+
+        switch (op_code) {
+        case 0:
+                fprintf(out, "if (r%u != 0) r%u = r%u;\n", c, a, b);
+                break;
+        case 1:
+                fprintf(out, "r%u = segment_at(mem, r%u)->segments[r%u];\n",
+                        a, b, c);
+                break;
+        case 2:
+                fprintf(out, "if (r%u == 0) STORE_M0(%u, r%u, r%u); "
+                        "else store(mem, r%u, r%u, r%u);\n",
+                        a, pc, b, c, a, b, c);
+                break;
+        case 3:
+                fprintf(out, "r%u = r%u + r%u;\n", a, b, c);
+                break;
+        case 4:
+                fprintf(out, "r%u = r%u * r%u;\n", a, b, c);
+                break;
+        case 5:
+                fprintf(out, "r%u = r%u / r%u;\n", a, b, c);
+                break;
+        case 6:
+                fprintf(out, "r%u = ~(r%u & r%u);\n", a, b, c);
+                break;
+        case 8:
+                fprintf(out, "r%u = map_segment(mem, r%u);\n", b, c);
+                break;
+        case 9:
+                fprintf(out, "unmap_segment(mem, r%u);\n", c);
+                break;
+        case 10:
+                fprintf(out, "output(io, r%u);\n", c);
+                break;
+        case 12:
+                fprintf(out, "if (r%u != 0) INTERPRET(%u); JUMP(r%u);\n",
+                        b, pc, c);
+                break;
+        case 13:
+                fprintf(out, "r%u = %u;\n", (word >> 25) & 0x7,
+                        word & 0x1ffffff);
+                break;
+        default:
+                /* Halt, Input and words that aren't instructions. */
+                fprintf(out, "INTERPRET(%u);\n", pc);
+                break;
+        }
+}
+
+/* Purpose: writes the function holding words first to last of m[0]
+* Input:    out -- the C file
+*           index -- the function's number
+*           words -- the program
+*           first, last -- the words, inclusive
+* Output:   none
+*/
+static void emit_function(FILE *out, uint32_t index, const uint32_t *words,
+                          uint32_t first, uint32_t last)
+{
+        fprintf(out, "static bool run_%u(um_T um)\n{\n"
+                "        ENTER();\n\n"
+                "        goto dispatch;\n\n", index);
+
+        for (uint32_t pc = first; pc <= last; pc++) {
+                emit_word(out, pc, words[pc]);
+        }
+
+        fprintf(out, "        pc = %u;\n"
+                "        goto leave;\n\n"
+                "dispatch:\n"
+                "        if (stale[pc]) {\n"
+                "                goto leave;\n"
+                "        }\n"
+                "        switch (pc) {\n", last + 1);
+        for (uint32_t pc = first; pc <= last; pc++) {
+                fprintf(out, "        case %u: goto L%u;\n", pc, pc);
+        }
+        fprintf(out, "        default: goto leave;\n"
+                "        }\n\n"
+                "leave:\n"
+                "        LEAVE();\n"
+                "}\n\n");
+}
+
+/* Purpose: writes a program as C
+* Input:    out -- the C file
+*           source -- the program's path, for the header comment
+*           words, num_words -- the program
+* Output:   none
+*/
+static void emit_program(FILE *out, const char *source,
+                         const uint32_t *words, uint32_t num_words)
+{
+        uint32_t num_functions = (num_words + WORDS_PER_FUNCTION - 1) /
+                                 WORDS_PER_FUNCTION;
+
+        fprintf(out, "/* Translated from %s by umc; do not edit. */\n",
+                source);
+        fputs(prologue, out);
+
+        fprintf(out, "#define NUM_WORDS %u\n"
+                "#define WORDS_PER_FUNCTION %u\n\n",
+                num_words, WORDS_PER_FUNCTION);
+        fprintf(out, "static const uint32_t words[NUM_WORDS + 1] = {");
+        for (uint32_t i = 0; i < num_words; i++) {
+                fprintf(out, "%s0x%08x,", (i % WORDS_PER_LINE == 0)
+                                          ? "\n        " : " ", words[i]);
+        }
+        fprintf(out, "\n        0\n};\n\n");
+
+        fputs(stale_marks, out);
+
+        for (uint32_t i = 0; i < num_functions; i++) {
+                uint32_t first = i * WORDS_PER_FUNCTION;
+                uint32_t last = first + WORDS_PER_FUNCTION - 1;
+
+                emit_function(out, i, words, first,
+                              (last < num_words) ? last : num_words - 1);
+        }
+
+        fprintf(out, "static bool (*const functions[%u + 1])(um_T) = {",
+                num_functions);
+        for (uint32_t i = 0; i < num_functions; i++) {
+                fprintf(out, "\n        run_%u,", i);
+        }
+        fprintf(out, "\n        NULL\n};\n\n");
+
+        fputs(epilogue, out);
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc != 3) {
+                fprintf(stderr, "Usage: %s program.um program.c\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        mem_T memory = mem_new();
+
+        if (!load_program_file(memory, argv[1])) {
+                mem_free(memory);
+                return EXIT_FAILURE;
+        }
+
+        FILE *out = fopen(argv[2], "w");
+        if (out == NULL) {
+                perror(argv[2]);
+                mem_free(memory);
+                return EXIT_FAILURE;
+        }
+
+        seg_T m0 = segment_at(memory, 0);
+
+        emit_program(out, argv[1], m0->segments, m0->seg_length);
+
+        bool written = (fclose(out) == 0);
+        if (!written) {
+                perror(argv[2]);
+                remove(argv[2]);
+        }
+
+        mem_free(memory);
+
+        return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#undef WORDS_PER_FUNCTION
+#undef WORDS_PER_LINE